@@ -1,3 +1,3 @@
 #!/bin/sh
 
-g++ -std=c++11 main.cpp uvc_linux.cpp
+g++ -std=c++11 main.cpp uvc_linux.cpp -pthread
@@ -3,6 +3,40 @@
 #include <iostream>
 #include <fcntl.h>
 #include <chrono>
+#include <ctime>
+
+#define BENCH_FRAMES 600
+
+struct bench_state_t
+{
+    std::chrono::steady_clock::time_point wall_start;
+    std::clock_t cpu_start;
+    int frames;
+};
+
+static void bench_start(bench_state_t* bench)
+{
+    bench->wall_start = std::chrono::steady_clock::now();
+    bench->cpu_start = std::clock();
+    bench->frames = 0;
+}
+
+// Prints wall and CPU time per frame every BENCH_FRAMES frames. The CPU time includes the conversion threads.
+static void bench_frames(bench_state_t* bench, const char* path, int count)
+{
+    bench->frames += count;
+    if (bench->frames < BENCH_FRAMES)
+        return;
+
+    auto wall = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bench->wall_start).count();
+    double cpu = (double)(std::clock() - bench->cpu_start) * 1000000.0 / CLOCKS_PER_SEC;
+
+    std::cout << path << ": " << bench->frames << " frames, " << wall / bench->frames << " us/frame wall ("
+              << (wall > 0 ? 1000000LL * bench->frames / wall : 0) << " FPS), "
+              << (long long)(cpu / bench->frames) << " us/frame CPU" << std::endl;
+
+    bench_start(bench);
+}
 
 int main(int argc, char** argv)
 {
@@ -93,17 +127,39 @@ int main(int argc, char** argv)
 
     unsigned char* colorbuf = new unsigned char[used_mode.width * used_mode.height * 3];
 
+    // --batch reads every ready frame per call. Both paths report the same numbers over
+    // BENCH_FRAMES frames so they can be compared on the same camera.
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+    {
+        uvc_batch_frame_t frames[UVC_BATCH_MAX];
+        for (int i = 0; i < UVC_BATCH_MAX; i++)
+        {
+            frames[i].color_dest = new unsigned char[used_mode.width * used_mode.height * 3];
+            frames[i].stats = NULL;
+        }
+
+        bench_state_t bench;
+        bench_start(&bench);
+
+        while (true)
+        {
+            int count = 0;
+            if (uvc_getDataBatch(dev_fd, frames, UVC_BATCH_MAX, &count, &used_mode) != 0)
+                return false;
+
+            bench_frames(&bench, "batch", count);
+        }
+    }
+
+    bench_state_t bench;
+    bench_start(&bench);
+
     while (true)
     {
-        std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
         if (uvc_getData(dev_fd, colorbuf, &used_mode) != 0)
             return false;
-        std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
-        auto dur = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
-
-        int fps = 1000000 / dur;
 
-        std::cout << "delta: " << dur <<  " us (" << fps << " FPS)" << std::endl;
+        bench_frames(&bench, "per-frame", 1);
     }
 
     return 0;
@@ -10,17 +10,38 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/select.h> 
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <linux/videodev2.h>
 #include <assert.h>
+#include <pthread.h>
 #include "uvc_linux.h"
 
 char devname[512];
 unsigned int n_buffers = 0;
+// Buffer count the stream grows to after a fast open
+unsigned int n_buffers_target = 0;
 
 #define thread_count 4
 #define STREAM_BUFFERS 20
+#define UVC_FAST_OPEN_BUFFERS 3
+#define UVC_NEGOTIATION_CACHE_TAG "uvc_negotiation"
+#define UVC_NEGOTIATION_CACHE_VERSION 1
+// How long an escalated recovery waits for the device node to come back after USB re-enumeration
+#define UVC_REOPEN_TIMEOUT_MS 10000
+#define UVC_REOPEN_POLL_MS 100
+// How long a restarted stream may take to deliver its first frame
+#define UVC_RECOVERY_FRAME_TIMEOUT_MS 1000
+// How many automatic recoveries a single read may do before it fails
+#define UVC_RECOVERIES_PER_READ 1
 
 struct buffer {
     void* start;
@@ -30,6 +51,30 @@ struct buffer {
 struct buffer* buffers = NULL;
 int framecount = 0;
 
+// Format and mode of the open device, reused when the stream has to be recovered
+struct v4l2_format stream_format;
+video_device_mode_info_t stream_vmode;
+
+uvc_open_timing_t open_timing;
+uint64_t open_started_us = 0;
+uint64_t stream_started_us = 0;
+
+int auto_recovery = 0;
+uvc_recovery_report_t recovery_report;
+
+int motion_enabled = 0;
+uvc_motion_params_t motion_params;
+video_device_mode_info_t motion_vmode;
+// Luma of the previous frame, one byte per pixel
+unsigned char* motion_previous = NULL;
+int motion_have_previous = 0;
+unsigned char* motion_mask = NULL;
+uvc_motion_result_t motion_result;
+
+uvc_frame_t frame_pool[UVC_FRAME_POOL_MAX];
+int frame_pool_count = 0;
+unsigned int frame_pool_exhausted = 0;
+
 void remove_all_chars(char* str, char c) {
     char *pr = str, *pw = str;
     while (*pr)
@@ -48,12 +93,83 @@ struct parse_uvc_image_params
     int start_y;
     int end_y;
     int width;
+    // Column range, only used by the region conversions
+    int start_x;
+    int end_x;
     unsigned char* src;
     unsigned char* src_origin;
     unsigned char* dst_rgb;
     unsigned char* dst_rgb_origin;
+    // Used by the *Stats conversions, which accumulate luma statistics of their rows here
+    uvc_frame_stats_t* stats;
+};
+
+static void uvc_resetStats(uvc_frame_stats_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->min = 0xFF;
+}
+
+// Statistics of one row. The kernels keep it in a local, so the sums stay in registers instead of being
+// reloaded around every output store, and fold it into the frame statistics once the row is done.
+struct uvc_row_stats_t
+{
+    uint32_t* histogram;
+    uint64_t luma_sum;
+    uint64_t gradient_sum;
+    unsigned char min;
+    unsigned char max;
 };
 
+static inline void uvc_beginRowStats(uvc_row_stats_t* row, uvc_frame_stats_t* stats)
+{
+    row->histogram = stats->histogram;
+    row->luma_sum = 0;
+    row->gradient_sum = 0;
+    row->min = 0xFF;
+    row->max = 0;
+}
+
+// Adds one luma sample. left is the sample before it on the same row, or the sample itself at the row start.
+static inline void uvc_accumulateStats(uvc_row_stats_t* row, unsigned char luma, unsigned char left)
+{
+    int diff = (int)luma - (int)left;
+
+    row->histogram[luma]++;
+    row->luma_sum += luma;
+    row->gradient_sum += diff * diff;
+    if (luma < row->min)
+        row->min = luma;
+    if (luma > row->max)
+        row->max = luma;
+}
+
+static inline void uvc_endRowStats(uvc_row_stats_t* row, uvc_frame_stats_t* stats)
+{
+    stats->luma_sum += row->luma_sum;
+    stats->gradient_sum += row->gradient_sum;
+    if (row->min < stats->min)
+        stats->min = row->min;
+    if (row->max > stats->max)
+        stats->max = row->max;
+}
+
+static void uvc_finishStats(uvc_frame_stats_t* stats)
+{
+    stats->pixel_count = 0;
+    for (int i = 0; i < 256; i++)
+        stats->pixel_count += stats->histogram[i];
+
+    if (stats->pixel_count == 0)
+    {
+        stats->min = 0;
+        return;
+    }
+
+    stats->mean = (double)stats->luma_sum / stats->pixel_count;
+    stats->sharpness = (double)stats->gradient_sum / stats->pixel_count;
+}
+
 void uvc_convertYUV422(void* params)
 {
     parse_uvc_image_params* p = (parse_uvc_image_params*)params;
@@ -112,6 +228,240 @@ void uvc_convertY8I(void* params)
     }
 }
 
+void uvc_convertYUV422Gray(void* params)
+{
+    // Luma only: every other byte is a Y sample, chroma is skipped entirely
+    parse_uvc_image_params* p = (parse_uvc_image_params*)params;
+    unsigned char* py = p->src;
+    unsigned char* tmp = p->dst_rgb;
+
+    int line, column;
+    for (line = p->start_y; line < p->end_y; ++line)
+    {
+        for (column = 0; column < p->width; ++column)
+        {
+            *tmp++ = *py;
+            py += 2;
+        }
+    }
+}
+
+void uvc_convertY8IGray(void* params)
+{
+    // Same side by side layout as uvc_convertY8I, one byte per pixel
+    parse_uvc_image_params* p = (parse_uvc_image_params*)params;
+    int line, column;
+    uint16_t* src16 = (uint16_t*)p->src_origin;
+    uint16_t temp;
+
+    for (line = p->start_y; line < p->end_y; ++line)
+    {
+        for (column = 0; column < p->width; ++column)
+        {
+            temp = src16[line * p->width + column];
+            p->dst_rgb_origin[line * p->width * 2 + column] = temp >> 8;
+            p->dst_rgb_origin[line * p->width * 2 + column + p->width] = 0xFF & temp;
+        }
+    }
+}
+
+/*
+ * The *Stats conversions below produce the same output as the plain ones, and additionally
+ * accumulate the luma statistics of every sample into p->stats. They are kept separate so that
+ * the plain conversions do not test for statistics on every pixel. Each row is gathered into a
+ * uvc_row_stats_t and merged into p->stats at its end; the frame itself is one band converted
+ * by the calling thread.
+ */
+
+void uvc_convertYUV422Stats(void* params)
+{
+    parse_uvc_image_params* p = (parse_uvc_image_params*)params;
+    unsigned char *py, *pu, *pv;
+    uvc_frame_stats_t* stats = p->stats;
+    uvc_row_stats_t row;
+    unsigned char left;
+
+    py = p->src;
+    pu = p->src + 1;
+    pv = p->src + 3;
+    unsigned char *tmp = p->dst_rgb;
+
+    int line, column;
+    for (line = p->start_y; line < p->end_y; ++line)
+    {
+        uvc_beginRowStats(&row, stats);
+        left = *py;
+        for (column = 0; column < p->width; ++column)
+        {
+            uvc_accumulateStats(&row, *py, left);
+            left = *py;
+
+            *tmp++ = CLIP((float)*py + 1.402*((float)*pv-128.0));
+            *tmp++ = CLIP((float)*py - 0.344*((float)*pu-128.0) - 0.714*((float)*pv-128.0));
+            *tmp++ = CLIP((float)*py + 1.772*((float)*pu-128.0));
+
+            py += 2;
+            if ((column & 1) == 1)
+            {
+                pu += 4;
+                pv += 4;
+            }
+        }
+        uvc_endRowStats(&row, stats);
+    }
+}
+
+void uvc_convertYUV422GrayStats(void* params)
+{
+    parse_uvc_image_params* p = (parse_uvc_image_params*)params;
+    unsigned char* py = p->src;
+    unsigned char* tmp = p->dst_rgb;
+    uvc_frame_stats_t* stats = p->stats;
+    uvc_row_stats_t row;
+    unsigned char luma, left;
+
+    int line, column;
+    for (line = p->start_y; line < p->end_y; ++line)
+    {
+        uvc_beginRowStats(&row, stats);
+        left = *py;
+        for (column = 0; column < p->width; ++column)
+        {
+            luma = *py;
+            uvc_accumulateStats(&row, luma, left);
+            left = luma;
+
+            *tmp++ = luma;
+            py += 2;
+        }
+        uvc_endRowStats(&row, stats);
+    }
+}
+
+// Both images of the Y8I pair count, each sample compared to its neighbour in its own image
+void uvc_convertY8IStats(void* params)
+{
+    parse_uvc_image_params* p = (parse_uvc_image_params*)params;
+    int line, column;
+    uint16_t* src16 = (uint16_t*)p->src_origin;
+    uvc_frame_stats_t* stats = p->stats;
+    uvc_row_stats_t row;
+    uint16_t temp, left;
+
+    for (line = p->start_y; line < p->end_y; ++line)
+    {
+        uvc_beginRowStats(&row, stats);
+        left = src16[line * p->width];
+        for (column = 0; column < p->width; ++column)
+        {
+            temp = src16[line * p->width + column];
+            p->dst_rgb_origin[3 * (line * p->width * 2 + column)] = temp >> 8;
+            p->dst_rgb_origin[3 * (line * p->width * 2 + column + p->width)] = 0xFF & temp;
+
+            uvc_accumulateStats(&row, temp >> 8, left >> 8);
+            uvc_accumulateStats(&row, 0xFF & temp, 0xFF & left);
+            left = temp;
+        }
+        uvc_endRowStats(&row, stats);
+    }
+}
+
+void uvc_convertY8IGrayStats(void* params)
+{
+    parse_uvc_image_params* p = (parse_uvc_image_params*)params;
+    int line, column;
+    uint16_t* src16 = (uint16_t*)p->src_origin;
+    uvc_frame_stats_t* stats = p->stats;
+    uvc_row_stats_t row;
+    uint16_t temp, left;
+
+    for (line = p->start_y; line < p->end_y; ++line)
+    {
+        uvc_beginRowStats(&row, stats);
+        left = src16[line * p->width];
+        for (column = 0; column < p->width; ++column)
+        {
+            temp = src16[line * p->width + column];
+            p->dst_rgb_origin[line * p->width * 2 + column] = temp >> 8;
+            p->dst_rgb_origin[line * p->width * 2 + column + p->width] = 0xFF & temp;
+
+            uvc_accumulateStats(&row, temp >> 8, left >> 8);
+            uvc_accumulateStats(&row, 0xFF & temp, 0xFF & left);
+            left = temp;
+        }
+        uvc_endRowStats(&row, stats);
+    }
+}
+
+void uvc_convertYUV422Region(void* params)
+{
+    // Converts the start_x..end_x, start_y..end_y rectangle of src_origin into a tightly packed dst_rgb
+    parse_uvc_image_params* p = (parse_uvc_image_params*)params;
+    unsigned char *row, *py, *pu, *pv;
+    unsigned char *tmp = p->dst_rgb;
+
+    int line, column;
+    for (line = p->start_y; line < p->end_y; ++line)
+    {
+        row = p->src_origin + line * p->width * 2;
+        for (column = p->start_x; column < p->end_x; ++column)
+        {
+            py = row + column * 2;
+            // The Cb and Cr are shared by the pixel pair starting at an even column
+            pu = row + (column & ~1) * 2 + 1;
+            pv = row + (column & ~1) * 2 + 3;
+
+            *tmp++ = CLIP((float)*py + 1.402*((float)*pv-128.0));
+            *tmp++ = CLIP((float)*py - 0.344*((float)*pu-128.0) - 0.714*((float)*pv-128.0));
+            *tmp++ = CLIP((float)*py + 1.772*((float)*pu-128.0));
+        }
+    }
+}
+
+void uvc_convertYUV422GrayRegion(void* params)
+{
+    parse_uvc_image_params* p = (parse_uvc_image_params*)params;
+    unsigned char *row;
+    unsigned char *tmp = p->dst_rgb;
+
+    int line, column;
+    for (line = p->start_y; line < p->end_y; ++line)
+    {
+        row = p->src_origin + line * p->width * 2;
+        for (column = p->start_x; column < p->end_x; ++column)
+            *tmp++ = row[column * 2];
+    }
+}
+
+void uvc_convertY8IRegion(void* params, int channels)
+{
+    // Columns index the unpacked image, where the second image starts at column width
+    parse_uvc_image_params* p = (parse_uvc_image_params*)params;
+    uint16_t* src16 = (uint16_t*)p->src_origin;
+    unsigned char *tmp = p->dst_rgb;
+    unsigned char value;
+
+    int line, column;
+    for (line = p->start_y; line < p->end_y; ++line)
+    {
+        for (column = p->start_x; column < p->end_x; ++column)
+        {
+            if (column < p->width)
+                value = src16[line * p->width + column] >> 8;
+            else
+                value = 0xFF & src16[line * p->width + column - p->width];
+
+            *tmp++ = value;
+            // Like uvc_convertY8I, the RGB layout only carries the value in the first channel
+            if (channels == 3)
+            {
+                *tmp++ = 0;
+                *tmp++ = 0;
+            }
+        }
+    }
+}
+
 // Try ioctl until ioctl completes with an error other than EINTR
 int uvc_do_ioctl(int dev_fd, int request, void* argument)
 {
@@ -344,55 +694,19 @@ int uvc_enumerate(video_device_mode_info_t* video_modes, int count, int* devmode
     return 0;
 }
 
-int uvc_openDevice(int dev_fd, video_device_mode_info_t* vmode)
+static uint64_t uvc_nowUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Sets the format of the device and updates vmode with what the device actually uses
+static int uvc_setFormat(int dev_fd, video_device_mode_info_t* vmode)
 {
-    memset(devname, '\0', 512);
-    strcpy(devname, vmode->dev_filename);
-    struct v4l2_capability capabilities;
-    struct v4l2_cropcap cropcap;
-    struct v4l2_crop crop;
     struct v4l2_format format;
     unsigned int min;
 
-    if (uvc_do_ioctl(dev_fd, VIDIOC_QUERYCAP, &capabilities) == -1)
-    {
-        fprintf(stderr, "ioctl VIDIOC_QUERYCAP failed: %s\n", devname);
-        return 1;
-    }
-
-    if (!(capabilities.capabilities & V4L2_CAP_VIDEO_CAPTURE))
-    {
-        fprintf(stderr, "Device does not support V4L2_CAP_VIDEO_CAPTURE: %s\n", devname);
-        return 1;
-    }
-
-    if (!(capabilities.capabilities & V4L2_CAP_STREAMING))
-    {
-        fprintf(stderr, "Device does not support V4L2_CAP_STREAMING, cannot mmap: %s\n", devname);
-        return 1;
-    }
-
-    memset(&cropcap, 0, sizeof(cropcap));
-
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (uvc_do_ioctl(dev_fd, VIDIOC_CROPCAP, &cropcap) == 0)
-    {
-        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        crop.c = cropcap.defrect;
-        if (uvc_do_ioctl(dev_fd, VIDIOC_S_CROP, &crop))
-        {
-            int errcode = errno;
-            switch (errcode)
-            {
-                case EINVAL:
-                    // Does not support cropping
-                    break;
-                default:
-                    break;
-            }
-        }
-    }
-
     memset(&format, 0, sizeof(format));
 
     format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -428,31 +742,146 @@ int uvc_openDevice(int dev_fd, video_device_mode_info_t* vmode)
     if (format.fmt.pix.sizeimage < min)
         format.fmt.pix.sizeimage = min;
 
-    fprintf(stderr, "UVC resolution negotiated to %d, %d\n", vmode->width, vmode->height);
+    stream_format = format;
+    stream_vmode = *vmode;
 
-    struct v4l2_requestbuffers req;
-    memset(&req, 0, sizeof(req));
+    fprintf(stderr, "UVC resolution negotiated to %d, %d\n", vmode->width, vmode->height);
 
-    // The request buffer count has some considerations:
-    // A high count will result in some frames being stored in memory if the UVC device
-    // produces frames faster than we can read. This can result in a delay in the video feed,
-    // but minimizes lost frames
-    // A low count makes sure the frame we're reading is always the most updated. This allows
-    // a video feed with no delays, but can result in data loss if we take too long to read a new frame
-    req.count = STREAM_BUFFERS;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+    return 0;
+}
 
-    // request buffers from device
-    int ret = uvc_do_ioctl(dev_fd, VIDIOC_REQBUFS, &req) == -1;
-    if (ret != 0)
+// Queries and mmaps the device buffers first .. first + count - 1. n_buffers is increased for each mapped buffer.
+static int uvc_mapBuffers(int dev_fd, unsigned int first, unsigned int count)
+{
+    for (n_buffers = first; n_buffers < first + count; n_buffers++)
     {
-        if (ret == EINVAL)
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = n_buffers;
+
+        if (uvc_do_ioctl(dev_fd, VIDIOC_QUERYBUF, &buf) == -1)
         {
-            fprintf(stderr, "cannot use mmap for device: %s\n", devname);
+            fprintf(stderr, "Failed getting buffers from device: %s\n", devname);
             return 1;
         }
-        else
+
+        buffers[n_buffers].length = buf.length;
+        buffers[n_buffers].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, buf.m.offset);
+        if (buffers[n_buffers].start == MAP_FAILED)
+        {
+            fprintf(stderr, "Failed mmapping device memory: %s\n", devname);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void uvc_releaseBuffers()
+{
+    unsigned int i = 0;
+    for (i = 0; i < n_buffers; i++)
+    {
+        if (munmap(buffers[i].start, buffers[i].length) == -1)
+        {
+            fprintf(stderr, "Failed unmapping memory\n");
+        }
+    }
+
+    free(buffers);
+    buffers = NULL;
+    n_buffers = 0;
+    n_buffers_target = 0;
+}
+
+int uvc_openDevice(int dev_fd, video_device_mode_info_t* vmode)
+{
+    memset(devname, '\0', 512);
+    strcpy(devname, vmode->dev_filename);
+    struct v4l2_capability capabilities;
+    struct v4l2_cropcap cropcap;
+    struct v4l2_crop crop;
+
+    memset(&open_timing, 0, sizeof(open_timing));
+    open_started_us = uvc_nowUs();
+    uint64_t phase_start = open_started_us;
+
+    if (uvc_do_ioctl(dev_fd, VIDIOC_QUERYCAP, &capabilities) == -1)
+    {
+        fprintf(stderr, "ioctl VIDIOC_QUERYCAP failed: %s\n", devname);
+        return 1;
+    }
+
+    if (!(capabilities.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+    {
+        fprintf(stderr, "Device does not support V4L2_CAP_VIDEO_CAPTURE: %s\n", devname);
+        return 1;
+    }
+
+    if (!(capabilities.capabilities & V4L2_CAP_STREAMING))
+    {
+        fprintf(stderr, "Device does not support V4L2_CAP_STREAMING, cannot mmap: %s\n", devname);
+        return 1;
+    }
+
+    open_timing.querycap_us = uvc_nowUs() - phase_start;
+    phase_start = uvc_nowUs();
+
+    memset(&cropcap, 0, sizeof(cropcap));
+
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (uvc_do_ioctl(dev_fd, VIDIOC_CROPCAP, &cropcap) == 0)
+    {
+        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        crop.c = cropcap.defrect;
+        if (uvc_do_ioctl(dev_fd, VIDIOC_S_CROP, &crop))
+        {
+            int errcode = errno;
+            switch (errcode)
+            {
+                case EINVAL:
+                    // Does not support cropping
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    open_timing.crop_us = uvc_nowUs() - phase_start;
+    phase_start = uvc_nowUs();
+
+    if (uvc_setFormat(dev_fd, vmode) != 0)
+        return 1;
+
+    open_timing.set_format_us = uvc_nowUs() - phase_start;
+    phase_start = uvc_nowUs();
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+
+    // The request buffer count has some considerations:
+    // A high count will result in some frames being stored in memory if the UVC device
+    // produces frames faster than we can read. This can result in a delay in the video feed,
+    // but minimizes lost frames
+    // A low count makes sure the frame we're reading is always the most updated. This allows
+    // a video feed with no delays, but can result in data loss if we take too long to read a new frame
+    req.count = STREAM_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    // request buffers from device
+    int ret = uvc_do_ioctl(dev_fd, VIDIOC_REQBUFS, &req) == -1;
+    if (ret != 0)
+    {
+        if (ret == EINVAL)
+        {
+            fprintf(stderr, "cannot use mmap for device: %s\n", devname);
+            return 1;
+        }
+        else
         {
             fprintf(stderr, "other error with allocating mmap for device: %s %s %d\n", devname, strerror(ret), ret);
             return 1;
@@ -473,47 +902,232 @@ int uvc_openDevice(int dev_fd, video_device_mode_info_t* vmode)
         return 1;
     }
 
+    open_timing.request_buffers_us = uvc_nowUs() - phase_start;
+    phase_start = uvc_nowUs();
+
     // n_buffers is set to whatever req.count is
-    for (n_buffers = 0; n_buffers < req.count; n_buffers++)
+    if (uvc_mapBuffers(dev_fd, 0, req.count) != 0)
+        return 1;
+
+    n_buffers_target = n_buffers;
+    open_timing.map_buffers_us = uvc_nowUs() - phase_start;
+    open_timing.initial_buffers = n_buffers;
+
+    fprintf(stderr, "mmaped device memory to %d buffers\n", n_buffers);
+
+    return 0;
+}
+
+int uvc_saveNegotiation(const char* path, video_device_mode_info_t* vmode)
+{
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
     {
-        struct v4l2_buffer buf;
-        memset(&buf, 0, sizeof(buf));
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = n_buffers;
+        fprintf(stderr, "Failed opening %s for writing\n", path);
+        return 1;
+    }
 
-        if (uvc_do_ioctl(dev_fd, VIDIOC_QUERYBUF, &buf) == -1)
-        {
-            fprintf(stderr, "Failed getting buffers from device: %s\n", devname);
-            return 1;
-        }
+    // Names may contain spaces, so each gets a line of its own
+    fprintf(f, "%s %d\n%s\n%s\n%d %u %u %u %u %u\n", UVC_NEGOTIATION_CACHE_TAG, UVC_NEGOTIATION_CACHE_VERSION,
+            vmode->dev_filename, vmode->dev_name, vmode->pixel_format, vmode->width, vmode->height,
+            stream_format.fmt.pix.bytesperline, stream_format.fmt.pix.sizeimage, n_buffers_target);
 
-        buffers[n_buffers].length = buf.length;
-        buffers[n_buffers].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, buf.m.offset);
-        if (buffers[n_buffers].start == MAP_FAILED)
-        {
-            fprintf(stderr, "Failed mmapping device memory: %s\n", devname);
+    if (fclose(f) != 0)
+    {
+        fprintf(stderr, "Failed writing %s\n", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Reads one line without its line break. Returns 0 on success.
+static int uvc_readLine(FILE* f, char* line, int size)
+{
+    if (fgets(line, size, f) == NULL)
+        return 1;
+
+    remove_all_chars(line, '\n');
+    remove_all_chars(line, '\r');
+    return 0;
+}
+
+// Reads a cache written by uvc_saveNegotiation. Returns 0 if it exists and matches the requested mode.
+static int uvc_loadNegotiation(const char* path, video_device_mode_info_t* vmode, unsigned int* sizeimage,
+                               unsigned int* buffer_count)
+{
+    char line[512];
+    char tag[64];
+    int version = 0;
+    int pixel_format = 0;
+    unsigned int width = 0, height = 0, bytesperline = 0;
+    int valid = 0;
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return 1;
+
+    do
+    {
+        if (uvc_readLine(f, line, sizeof(line)) != 0 || sscanf(line, "%63s %d", tag, &version) != 2)
+            break;
+        if (strcmp(tag, UVC_NEGOTIATION_CACHE_TAG) != 0 || version != UVC_NEGOTIATION_CACHE_VERSION)
+            break;
+        if (uvc_readLine(f, line, sizeof(line)) != 0 || strcmp(line, vmode->dev_filename) != 0)
+            break;
+        if (uvc_readLine(f, line, sizeof(line)) != 0 || strcmp(line, vmode->dev_name) != 0)
+            break;
+        if (uvc_readLine(f, line, sizeof(line)) != 0)
+            break;
+        if (sscanf(line, "%d %u %u %u %u %u", &pixel_format, &width, &height, &bytesperline, sizeimage, buffer_count) != 6)
+            break;
+        valid = 1;
+    } while (0);
+
+    fclose(f);
+
+    if (!valid || pixel_format != vmode->pixel_format || width != vmode->width || height != vmode->height
+            || *buffer_count == 0)
+    {
+        fprintf(stderr, "Negotiation cache %s does not match %s, using full open\n", path, vmode->dev_filename);
+        return 1;
+    }
+
+    return 0;
+}
+
+int uvc_openDeviceFast(int dev_fd, video_device_mode_info_t* vmode, const char* cache_path)
+{
+    unsigned int buffer_count = 0;
+    unsigned int sizeimage = 0;
+
+    if (uvc_loadNegotiation(cache_path, vmode, &sizeimage, &buffer_count) != 0)
+    {
+        if (uvc_openDevice(dev_fd, vmode) != 0)
             return 1;
-        }
+
+        // Failing to write the cache only costs the next open its speed
+        uvc_saveNegotiation(cache_path, vmode);
+        return 0;
     }
 
-    fprintf(stderr, "mmaped device memory to %d buffers\n", n_buffers);
+    memset(devname, '\0', 512);
+    strcpy(devname, vmode->dev_filename);
+
+    memset(&open_timing, 0, sizeof(open_timing));
+    open_timing.fast_open = 1;
+    open_started_us = uvc_nowUs();
+    uint64_t phase_start = open_started_us;
+
+    // The device was known to support capture and streaming with this mode, skip QUERYCAP and cropping.
+    // The format is not persisted by the device over a reopen and has to be set again.
+    if (uvc_setFormat(dev_fd, vmode) != 0)
+        return 1;
+
+    // Refresh a cache the device no longer agrees with, this open still works with the new format
+    if (stream_format.fmt.pix.sizeimage != sizeimage)
+    {
+        fprintf(stderr, "Device %s changed its frame size from %d to %d bytes\n", devname, sizeimage,
+                stream_format.fmt.pix.sizeimage);
+        n_buffers_target = buffer_count;
+        uvc_saveNegotiation(cache_path, vmode);
+    }
+
+    open_timing.set_format_us = uvc_nowUs() - phase_start;
+    phase_start = uvc_nowUs();
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+
+    // Start streaming with a few buffers, the rest are added once frames flow
+    req.count = UVC_FAST_OPEN_BUFFERS < buffer_count ? UVC_FAST_OPEN_BUFFERS : buffer_count;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    if (uvc_do_ioctl(dev_fd, VIDIOC_REQBUFS, &req) == -1 || req.count == 0)
+    {
+        int errcode = errno;
+        fprintf(stderr, "Failed requesting buffers for device: %s %s %d\n", devname, strerror(errcode), errcode);
+        return 1;
+    }
+
+    buffers = (buffer*)calloc(buffer_count > req.count ? buffer_count : req.count, sizeof(*buffers));
+    if (!buffers)
+    {
+        fprintf(stderr, "Out of memory when allocating buffers\n");
+        return 1;
+    }
+
+    open_timing.request_buffers_us = uvc_nowUs() - phase_start;
+    phase_start = uvc_nowUs();
+
+    if (uvc_mapBuffers(dev_fd, 0, req.count) != 0)
+        return 1;
+
+    n_buffers_target = buffer_count > n_buffers ? buffer_count : n_buffers;
+    open_timing.map_buffers_us = uvc_nowUs() - phase_start;
+    open_timing.initial_buffers = n_buffers;
+
+    fprintf(stderr, "mmaped device memory to %d of %d buffers\n", n_buffers, n_buffers_target);
 
     return 0;
 }
 
-int uvc_cleanup(int dev_fd)
+// Adds one buffer to a stream opened with uvc_openDeviceFast, until it has as many as a full open would
+static void uvc_growBuffers(int dev_fd)
 {
-    unsigned int i = 0;
-    for (i = 0; i < n_buffers; i++)
+    struct v4l2_create_buffers create;
+    memset(&create, 0, sizeof(create));
+    create.count = 1;
+    create.memory = V4L2_MEMORY_MMAP;
+    create.format = stream_format;
+
+    if (uvc_do_ioctl(dev_fd, VIDIOC_CREATE_BUFS, &create) == -1 || create.count == 0)
     {
-        if (munmap(buffers[i].start, buffers[i].length) == -1)
-        {
-            fprintf(stderr, "Failed unmapping memory\n");
-        }
+        int errcode = errno;
+        fprintf(stderr, "Cannot add buffers while streaming, staying at %d buffers: %s %d\n",
+                n_buffers, strerror(errcode), errcode);
+        n_buffers_target = n_buffers;
+        return;
     }
 
-    free(buffers);
+    unsigned int first = n_buffers;
+    if (create.index != first || uvc_mapBuffers(dev_fd, first, 1) != 0)
+    {
+        fprintf(stderr, "Failed mapping added buffer %d, staying at %d buffers\n", create.index, first);
+        n_buffers = first;
+        n_buffers_target = first;
+        return;
+    }
+
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = first;
+
+    if (uvc_do_ioctl(dev_fd, VIDIOC_QBUF, &buf) == -1)
+    {
+        int errcode = errno;
+        fprintf(stderr, "ioctl VIDIOC_QBUF failed: %s %d\n", strerror(errcode), errcode);
+    }
+
+    if (n_buffers == n_buffers_target)
+        fprintf(stderr, "mmaped device memory to %d buffers\n", n_buffers);
+}
+
+int uvc_getOpenTiming(uvc_open_timing_t* timing)
+{
+    *timing = open_timing;
+    return open_timing.time_to_first_frame_us == 0 ? 1 : 0;
+}
+
+static void uvc_stopBatchWorkers();
+
+int uvc_cleanup(int dev_fd)
+{
+    uvc_stopBatchWorkers();
+    uvc_releaseBuffers();
 
     if (close(dev_fd) == -1)
     {
@@ -528,6 +1142,7 @@ int uvc_openStream(int dev_fd)
 {
     unsigned int i;
     enum v4l2_buf_type type;
+    uint64_t phase_start = uvc_nowUs();
 
     for (i = 0; i < n_buffers; ++i)
     {
@@ -555,6 +1170,13 @@ int uvc_openStream(int dev_fd)
         return 1;
     }
 
+    // Restarts during recovery are not part of opening the device
+    if (open_timing.time_to_first_frame_us == 0)
+    {
+        open_timing.stream_on_us = uvc_nowUs() - phase_start;
+        stream_started_us = uvc_nowUs();
+    }
+
     return 0;
 }
 
@@ -570,52 +1192,393 @@ int uvc_closeStream(int dev_fd)
     return 0;
 }
 
-int uvc_getData(int dev_fd, unsigned char* color_dest, video_device_mode_info_t* vmode)
+// Waits until the device has a filled buffer, without taking it
+static int uvc_waitReadable(int dev_fd, int timeout_ms)
 {
     for (;;)
     {
-        // Create a file descriptor set for select to fill
         fd_set fds;
         struct timeval tv;
-        int r;
 
-        // Reset file descriptor states
         FD_ZERO(&fds);
-        // Add the device fd as the only entry for fds to wait
         FD_SET(dev_fd, &fds);
 
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
 
-        // Select waits until the file desctiptors up to the first param are updated
-        // or if timeout happens
-        r = select(dev_fd + 1, &fds, NULL, NULL, &tv);
-        int errcode = errno;
-        if (r == -1)
-        {
-            if (errcode == EINTR)
-            {
-                // Try again
-                continue;
-            }
+        int r = select(dev_fd + 1, &fds, NULL, NULL, &tv);
+        if (r == -1 && errno == EINTR)
+            continue;
 
-            fprintf(stderr, "select failed: %s %d\n", strerror(errcode), errcode);
-            return 1;
-        }
-        else if (r == 0)
-        {
-            fprintf(stderr, "select timeout\n");
-            return 1;
-        }
+        return r > 0 ? 0 : 1;
+    }
+}
 
-        struct v4l2_buffer buf;
-        memset(&buf, 0, sizeof(buf));
+// Restarts streaming on the existing buffers and mappings
+static int uvc_restartStream(int dev_fd)
+{
+    // STREAMOFF takes every buffer away from the device, including any lost to the failure,
+    // so all of them can be queued again
+    if (uvc_closeStream(dev_fd) != 0)
+        return 1;
 
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
+    if (uvc_openStream(dev_fd) != 0)
+        return 1;
+
+    if (uvc_waitReadable(dev_fd, UVC_RECOVERY_FRAME_TIMEOUT_MS) != 0)
+    {
+        fprintf(stderr, "No frames after restarting the stream of %s\n", devname);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Opens the device node again and replaces dev_fd with it, keeping the descriptor number valid for the caller
+static int uvc_reopenDevice(int dev_fd)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    video_device_mode_info_t vmode = stream_vmode;
+    uint64_t deadline = uvc_nowUs() + (uint64_t)UVC_REOPEN_TIMEOUT_MS * 1000;
+
+    // These fail harmlessly if the device is already gone
+    uvc_do_ioctl(dev_fd, VIDIOC_STREAMOFF, &type);
+    uvc_releaseBuffers();
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = 0;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    uvc_do_ioctl(dev_fd, VIDIOC_REQBUFS, &req);
+
+    for (;;)
+    {
+        // After a USB reset the node disappears until the device has enumerated again
+        int new_fd = open(devname, O_RDWR | O_NONBLOCK, 0);
+        if (new_fd != -1)
+        {
+            if (dup2(new_fd, dev_fd) == -1)
+            {
+                int errcode = errno;
+                fprintf(stderr, "Failed replacing device fd: %s %d\n", strerror(errcode), errcode);
+                close(new_fd);
+                return 1;
+            }
+            close(new_fd);
+
+            video_device_mode_info_t used = vmode;
+            if (uvc_openDevice(dev_fd, &used) == 0 && uvc_openStream(dev_fd) == 0
+                    && uvc_waitReadable(dev_fd, UVC_RECOVERY_FRAME_TIMEOUT_MS) == 0)
+            {
+                if (used.width != vmode.width || used.height != vmode.height || used.pixel_format != vmode.pixel_format)
+                {
+                    fprintf(stderr, "Device %s came back with a different mode: %d x %d, %d\n",
+                            devname, used.width, used.height, used.pixel_format);
+                    return 1;
+                }
+
+                return 0;
+            }
+
+            uvc_do_ioctl(dev_fd, VIDIOC_STREAMOFF, &type);
+            uvc_releaseBuffers();
+            uvc_do_ioctl(dev_fd, VIDIOC_REQBUFS, &req);
+        }
+
+        if (uvc_nowUs() > deadline)
+        {
+            fprintf(stderr, "Device %s did not come back in %d ms\n", devname, UVC_REOPEN_TIMEOUT_MS);
+            return 1;
+        }
+
+        usleep(UVC_REOPEN_POLL_MS * 1000);
+    }
+}
+
+static const char* uvc_recoveryReasonName(int reason)
+{
+    switch (reason)
+    {
+    case UVC_RECOVERY_EIO:
+        return "EIO";
+    case UVC_RECOVERY_TIMEOUT:
+        return "select timeout";
+    case UVC_RECOVERY_DISCONNECT:
+        return "disconnect";
+    default:
+        return "request";
+    }
+}
+
+int uvc_recoverStream(int dev_fd, int reason)
+{
+    uint64_t start = uvc_nowUs();
+
+    fprintf(stderr, "Recovering stream of %s after %s\n", devname, uvc_recoveryReasonName(reason));
+
+    recovery_report.reason = reason;
+    recovery_report.escalated = 0;
+
+    // STREAMOFF / STREAMON cannot work on an unregistered node, a disconnect always reopens
+    int ret = 1;
+    if (reason != UVC_RECOVERY_DISCONNECT)
+        ret = uvc_restartStream(dev_fd);
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "Restarting the stream %s, reopening %s\n",
+                reason == UVC_RECOVERY_DISCONNECT ? "is not possible" : "failed", devname);
+        recovery_report.escalated = 1;
+
+        // The reopen goes through uvc_openDevice, which would replace the instrumentation of the
+        // real open. Its duration is reported in recovery_report instead.
+        uvc_open_timing_t saved_timing = open_timing;
+        uint64_t saved_open_started_us = open_started_us;
+        uint64_t saved_stream_started_us = stream_started_us;
+
+        ret = uvc_reopenDevice(dev_fd);
+
+        open_timing = saved_timing;
+        open_started_us = saved_open_started_us;
+        stream_started_us = saved_stream_started_us;
+    }
+
+    recovery_report.success = ret == 0;
+    recovery_report.duration_us = uvc_nowUs() - start;
+    recovery_report.total_duration_us += recovery_report.duration_us;
+    recovery_report.count++;
+
+    fprintf(stderr, "Stream recovery of %s %s in %d ms%s\n", devname, ret == 0 ? "succeeded" : "failed",
+            (int)(recovery_report.duration_us / 1000), recovery_report.escalated ? " (reopened)" : "");
+
+    return ret;
+}
+
+void uvc_setAutoRecovery(int enabled)
+{
+    auto_recovery = enabled;
+}
+
+int uvc_getRecoveryReport(uvc_recovery_report_t* report)
+{
+    *report = recovery_report;
+    return recovery_report.count == 0 ? 1 : 0;
+}
+
+// Sum of absolute luma differences of one block row of YUYV data against the previous luma,
+// which is then replaced by the current luma
+static unsigned int uvc_sadLumaRow(unsigned char* yuyv, unsigned char* previous, unsigned int pixels)
+{
+    unsigned int sad = 0;
+    for (unsigned int i = 0; i < pixels; i++)
+    {
+        int diff = (int)yuyv[i * 2] - (int)previous[i];
+        sad += diff < 0 ? -diff : diff;
+        previous[i] = yuyv[i * 2];
+    }
+    return sad;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same as uvc_sadLumaRow for a full UVC_MOTION_BLOCK_SIZE wide block row
+__attribute__((target("avx2")))
+static unsigned int uvc_sadLumaBlockRowAVX2(unsigned char* yuyv, unsigned char* previous)
+{
+    // 16 YUYV pixels are 32 bytes: keep the Y bytes as 16-bit values, so that psadbw
+    // sums only luma differences as the zeroed chroma bytes match on both sides
+    const __m256i luma_mask = _mm256_set1_epi16(0x00FF);
+    __m256i current = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)yuyv), luma_mask);
+    __m256i before = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)previous));
+    __m256i sad = _mm256_sad_epu8(current, before);
+
+    // Pack the 16 Y values back to bytes for the next frame
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(current, current), 0xD8);
+    _mm_storeu_si128((__m128i*)previous, _mm256_castsi256_si128(packed));
+
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(sad), _mm256_extracti128_si256(sad, 1));
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+    return (unsigned int)_mm_cvtsi128_si32(sum);
+}
+#endif
+
+static int uvc_cpuHasAVX2()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static int has_avx2 = -1;
+    if (has_avx2 == -1)
+        has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return has_avx2;
+#else
+    return 0;
+#endif
+}
+
+int uvc_enableMotionDetection(video_device_mode_info_t* vmode, uvc_motion_params_t* params)
+{
+    uvc_disableMotionDetection();
+
+    motion_params = *params;
+    if (motion_params.row_step == 0)
+        motion_params.row_step = 1;
+    if (motion_params.min_changed_blocks == 0)
+        motion_params.min_changed_blocks = 1;
+
+    motion_vmode = *vmode;
+
+    memset(&motion_result, 0, sizeof(motion_result));
+    motion_result.blocks_x = (vmode->width + UVC_MOTION_BLOCK_SIZE - 1) / UVC_MOTION_BLOCK_SIZE;
+    motion_result.blocks_y = (vmode->height + UVC_MOTION_BLOCK_SIZE - 1) / UVC_MOTION_BLOCK_SIZE;
+
+    motion_previous = (unsigned char*)memalign(UVC_FRAME_ALIGNMENT, (size_t)vmode->width * vmode->height);
+    motion_mask = (unsigned char*)calloc(motion_result.blocks_x * motion_result.blocks_y, 1);
+    if (motion_previous == NULL || motion_mask == NULL)
+    {
+        fprintf(stderr, "Out of memory when allocating motion detection buffers\n");
+        uvc_disableMotionDetection();
+        return 1;
+    }
+
+    motion_result.block_mask = motion_mask;
+    motion_have_previous = 0;
+    motion_enabled = 1;
+
+    return 0;
+}
+
+void uvc_disableMotionDetection()
+{
+    free(motion_previous);
+    free(motion_mask);
+    motion_previous = NULL;
+    motion_mask = NULL;
+    motion_enabled = 0;
+}
+
+int uvc_getMotionResult(uvc_motion_result_t* result)
+{
+    if (!motion_enabled)
+        return 1;
+
+    *result = motion_result;
+    return 0;
+}
+
+// Compares the luma of the given device buffer against the previous frame.
+// Returns 1 if the frame changed.
+static int uvc_detectMotion(unsigned char* source, video_device_mode_info_t* vmode)
+{
+    if (!motion_enabled || vmode->pixel_format != UVC_PIXELFORMAT_YUV422
+            || vmode->width != motion_vmode.width || vmode->height != motion_vmode.height)
+    {
+        return 1;
+    }
+
+    unsigned int width = vmode->width;
+    unsigned int height = vmode->height;
+    unsigned int row_step = motion_params.row_step;
+    int use_avx2 = uvc_cpuHasAVX2();
+    unsigned int changed_blocks = 0;
+
+    for (unsigned int block_y = 0; block_y < motion_result.blocks_y; block_y++)
+    {
+        unsigned int start_y = block_y * UVC_MOTION_BLOCK_SIZE;
+        unsigned int end_y = start_y + UVC_MOTION_BLOCK_SIZE;
+        if (end_y > height)
+            end_y = height;
+
+        for (unsigned int block_x = 0; block_x < motion_result.blocks_x; block_x++)
+        {
+            unsigned int start_x = block_x * UVC_MOTION_BLOCK_SIZE;
+            unsigned int pixels = UVC_MOTION_BLOCK_SIZE;
+            if (start_x + pixels > width)
+                pixels = width - start_x;
+
+            unsigned int sad = 0;
+            unsigned int sampled = 0;
+
+            for (unsigned int line = start_y; line < end_y; line += row_step)
+            {
+                unsigned char* yuyv = source + ((size_t)line * width + start_x) * 2;
+                unsigned char* previous = motion_previous + (size_t)line * width + start_x;
+
+#if defined(__x86_64__) || defined(__i386__)
+                if (use_avx2 && pixels == UVC_MOTION_BLOCK_SIZE)
+                    sad += uvc_sadLumaBlockRowAVX2(yuyv, previous);
+                else
+#endif
+                    sad += uvc_sadLumaRow(yuyv, previous, pixels);
+
+                sampled += pixels;
+            }
+
+            // The first frame has nothing to compare against and counts as changed everywhere
+            unsigned char block_changed = !motion_have_previous || sad > motion_params.threshold * sampled;
+            motion_mask[block_y * motion_result.blocks_x + block_x] = block_changed;
+            changed_blocks += block_changed;
+        }
+    }
+
+    (void)use_avx2;
+
+    motion_result.changed_blocks = changed_blocks;
+    motion_result.changed = !motion_have_previous || changed_blocks >= motion_params.min_changed_blocks;
+    motion_have_previous = 1;
+
+    return motion_result.changed;
+}
+
+// Waits for the device to fill a buffer and takes it away from the device's write queue
+static int uvc_dequeueBuffer(int dev_fd, struct v4l2_buffer* buf)
+{
+    // A device that keeps failing right after each recovery is reported to the caller
+    int recoveries_left = UVC_RECOVERIES_PER_READ;
+
+    for (;;)
+    {
+        // Create a file descriptor set for select to fill
+        fd_set fds;
+        struct timeval tv;
+        int r;
+
+        // Reset file descriptor states
+        FD_ZERO(&fds);
+        // Add the device fd as the only entry for fds to wait
+        FD_SET(dev_fd, &fds);
+
+        tv.tv_sec = 2;
+        tv.tv_usec = 0;
+
+        // Select waits until the file desctiptors up to the first param are updated
+        // or if timeout happens
+        r = select(dev_fd + 1, &fds, NULL, NULL, &tv);
+        int errcode = errno;
+        if (r == -1)
+        {
+            if (errcode == EINTR)
+            {
+                // Try again
+                continue;
+            }
+
+            fprintf(stderr, "select failed: %s %d\n", strerror(errcode), errcode);
+            return 1;
+        }
+        else if (r == 0)
+        {
+            fprintf(stderr, "select timeout\n");
+            if (auto_recovery && recoveries_left-- > 0 && uvc_recoverStream(dev_fd, UVC_RECOVERY_TIMEOUT) == 0)
+                continue;
+            return 1;
+        }
+
+        memset(buf, 0, sizeof(*buf));
+
+        buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf->memory = V4L2_MEMORY_MMAP;
 
         // Take this buffer away from the device's write queue
-        if (uvc_do_ioctl(dev_fd, VIDIOC_DQBUF, &buf) == -1)
+        if (uvc_do_ioctl(dev_fd, VIDIOC_DQBUF, buf) == -1)
         {
             int errcode = errno;
             if (errcode == EAGAIN)
@@ -623,7 +1586,19 @@ int uvc_getData(int dev_fd, unsigned char* color_dest, video_device_mode_info_t*
 
             if (errcode == EIO)
             {
+                // The buffer index is not valid, and the device may have stopped capturing
                 fprintf(stderr, "EIO in ioctl VIDIOC_DQBUF\n");
+                if (auto_recovery && recoveries_left-- > 0 && uvc_recoverStream(dev_fd, UVC_RECOVERY_EIO) == 0)
+                    continue;
+                return 1;
+            }
+            else if (errcode == ENODEV || errcode == ENXIO)
+            {
+                // The device was unplugged or is re-enumerating, its node is gone
+                fprintf(stderr, "Device disconnected in ioctl VIDIOC_DQBUF: %s %d\n", strerror(errcode), errcode);
+                if (auto_recovery && recoveries_left-- > 0 && uvc_recoverStream(dev_fd, UVC_RECOVERY_DISCONNECT) == 0)
+                    continue;
+                return 1;
             }
             else
             {
@@ -632,47 +1607,1103 @@ int uvc_getData(int dev_fd, unsigned char* color_dest, video_device_mode_info_t*
             }
         }
 
-        assert(buf.index < n_buffers);
-        unsigned char* source = (unsigned char*)buffers[buf.index].start;
+        assert(buf->index < n_buffers);
+
+        if (open_timing.time_to_first_frame_us == 0)
+        {
+            uint64_t now = uvc_nowUs();
+            open_timing.first_frame_us = now - stream_started_us;
+            open_timing.time_to_first_frame_us = now - open_started_us;
+            fprintf(stderr, "First frame from %s after %d ms\n", devname, (int)(open_timing.time_to_first_frame_us / 1000));
+        }
 
-        parse_uvc_image_params params;
+        return 0;
+    }
+}
 
-        int work_start_y = 0;
-        unsigned char* dest_write_color = color_dest;
-        unsigned char* source_read = source;
+// Tell the device it can again write data in this buffer
+static int uvc_queueBuffer(int dev_fd, struct v4l2_buffer* buf)
+{
+    if (uvc_do_ioctl(dev_fd, VIDIOC_QBUF, buf) == -1)
+    {
+        int errcode = errno;
+        fprintf(stderr, "ioctl VIDIOC_QBUF failed: %s %d\n", strerror(errcode), errcode);
+        return 1;
+    }
 
-        params.dst_rgb = dest_write_color;
-        params.dst_rgb_origin = color_dest;
-        params.src = source_read;
-        params.src_origin = source;
-        params.start_y = work_start_y;
-        params.end_y = vmode->height;
-        params.width = vmode->width;
+    // After a fast open, add the remaining buffers one per frame
+    if (n_buffers < n_buffers_target)
+        uvc_growBuffers(dev_fd);
 
-        switch (vmode->pixel_format)
-        {
-        case UVC_PIXELFORMAT_YUV422:
-            uvc_convertYUV422(&params);
-            break;
-        case UVC_PIXELFORMAT_Y8I:
-            uvc_convertY8I(&params);
-            break;
-        default:
-            fprintf(stderr, "Cannot decompress data: Unknown pixel format: %d\n", vmode->pixel_format);
-            return 1;
-        }
+    return 0;
+}
 
-        // Tell the device it can again write data in this buffer
-        if (uvc_do_ioctl(dev_fd ,VIDIOC_QBUF, &buf) == -1)
-        {
-            int errcode = errno;
-            fprintf(stderr, "ioctl VIDIOC_QBUF failed: %s %d\n", strerror(errcode), errcode);
-            return 1;
-        }
+// Width in pixels of the image produced by the conversion functions for the given mode
+static unsigned int uvc_layoutWidth(video_device_mode_info_t* vmode)
+{
+    // Y8I unpacks both stereo images side by side
+    if (vmode->pixel_format == UVC_PIXELFORMAT_Y8I)
+        return vmode->width * 2;
 
+    return vmode->width;
+}
+
+static unsigned int uvc_layoutChannels(int layout)
+{
+    return layout == UVC_LAYOUT_GRAY ? 1 : 3;
+}
+
+// Size of the raw device data kept by a frame. Both supported formats use 2 bytes per pixel.
+static size_t uvc_rawSize(video_device_mode_info_t* vmode)
+{
+    return (size_t)vmode->width * vmode->height * 2;
+}
+
+typedef void (*uvc_convert_func)(void* params);
+
+// Runs the conversion over the whole frame. With stats, the statistics kernel is run and its result finished.
+static void uvc_convertFrame(uvc_convert_func convert, uvc_convert_func convert_stats, unsigned char* source,
+                             unsigned char* dest, video_device_mode_info_t* vmode, uvc_frame_stats_t* stats)
+{
+    parse_uvc_image_params params;
+
+    params.src = source;
+    params.src_origin = source;
+    params.dst_rgb = dest;
+    params.dst_rgb_origin = dest;
+    params.start_y = 0;
+    params.end_y = vmode->height;
+    params.width = vmode->width;
+    params.stats = stats;
+
+    if (stats == NULL)
+    {
+        convert(&params);
+        return;
+    }
+
+    uvc_resetStats(stats);
+    convert_stats(&params);
+    uvc_finishStats(stats);
+}
+
+static int uvc_convertToRGB(unsigned char* source, unsigned char* color_dest, video_device_mode_info_t* vmode,
+                            uvc_frame_stats_t* stats)
+{
+    switch (vmode->pixel_format)
+    {
+    case UVC_PIXELFORMAT_YUV422:
+        uvc_convertFrame(uvc_convertYUV422, uvc_convertYUV422Stats, source, color_dest, vmode, stats);
+        break;
+    case UVC_PIXELFORMAT_Y8I:
+        uvc_convertFrame(uvc_convertY8I, uvc_convertY8IStats, source, color_dest, vmode, stats);
+        break;
+    default:
+        fprintf(stderr, "Cannot decompress data: Unknown pixel format: %d\n", vmode->pixel_format);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int uvc_convertToGray(unsigned char* source, unsigned char* gray_dest, video_device_mode_info_t* vmode,
+                             uvc_frame_stats_t* stats)
+{
+    switch (vmode->pixel_format)
+    {
+    case UVC_PIXELFORMAT_YUV422:
+        uvc_convertFrame(uvc_convertYUV422Gray, uvc_convertYUV422GrayStats, source, gray_dest, vmode, stats);
+        break;
+    case UVC_PIXELFORMAT_Y8I:
+        uvc_convertFrame(uvc_convertY8IGray, uvc_convertY8IGrayStats, source, gray_dest, vmode, stats);
         break;
+    default:
+        fprintf(stderr, "Cannot decompress data: Unknown pixel format: %d\n", vmode->pixel_format);
+        return 1;
     }
 
     return 0;
 }
 
+int uvc_getData(int dev_fd, unsigned char* color_dest, video_device_mode_info_t* vmode)
+{
+    return uvc_getDataStats(dev_fd, color_dest, vmode, NULL);
+}
+
+int uvc_getDataStats(int dev_fd, unsigned char* color_dest, video_device_mode_info_t* vmode, uvc_frame_stats_t* stats)
+{
+    struct v4l2_buffer buf;
+
+    if (uvc_dequeueBuffer(dev_fd, &buf) != 0)
+        return 1;
+
+    unsigned char* source = (unsigned char*)buffers[buf.index].start;
+
+    // A static frame would convert to the image already in color_dest
+    int changed = uvc_detectMotion(source, vmode);
+
+    if ((changed || !motion_params.skip_static) && uvc_convertToRGB(source, color_dest, vmode, stats) != 0)
+        return 1;
+
+    if (uvc_queueBuffer(dev_fd, &buf) != 0)
+        return 1;
+
+    return 0;
+}
+
+struct uvc_batch_job_t
+{
+    unsigned char* source;
+    unsigned char* dest;
+    uvc_frame_stats_t* stats;
+};
+
+// Worker threads converting the frames of a batch. The calling thread converts too.
+pthread_t batch_threads[thread_count - 1];
+int batch_threads_started = 0;
+int batch_threads_stop = 0;
+pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t batch_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;
+uvc_batch_job_t batch_jobs[UVC_BATCH_MAX];
+video_device_mode_info_t batch_vmode;
+int batch_job_count = 0;
+int batch_next_job = 0;
+int batch_jobs_done = 0;
+int batch_failed = 0;
+
+// Converts jobs of the current batch until none are left. Called with batch_lock held.
+static void uvc_runBatchJobs()
+{
+    while (batch_next_job < batch_job_count)
+    {
+        uvc_batch_job_t job = batch_jobs[batch_next_job++];
+        pthread_mutex_unlock(&batch_lock);
+
+        int ret = uvc_convertToRGB(job.source, job.dest, &batch_vmode, job.stats);
+
+        pthread_mutex_lock(&batch_lock);
+        if (ret != 0)
+            batch_failed = 1;
+        if (++batch_jobs_done == batch_job_count)
+            pthread_cond_signal(&batch_done);
+    }
+}
+
+static void* uvc_batchWorker(void*)
+{
+    pthread_mutex_lock(&batch_lock);
+    while (!batch_threads_stop)
+    {
+        if (batch_next_job < batch_job_count)
+            uvc_runBatchJobs();
+        else
+            pthread_cond_wait(&batch_start, &batch_lock);
+    }
+    pthread_mutex_unlock(&batch_lock);
+
+    return NULL;
+}
+
+static void uvc_startBatchWorkers()
+{
+    if (batch_threads_started)
+        return;
+
+    batch_threads_stop = 0;
+    for (int i = 0; i < thread_count - 1; i++)
+    {
+        if (pthread_create(&batch_threads[batch_threads_started], NULL, uvc_batchWorker, NULL) != 0)
+        {
+            // The batch still gets converted, just with fewer threads
+            fprintf(stderr, "Failed starting batch conversion thread\n");
+            break;
+        }
+        batch_threads_started++;
+    }
+}
+
+static void uvc_stopBatchWorkers()
+{
+    pthread_mutex_lock(&batch_lock);
+    batch_threads_stop = 1;
+    pthread_cond_broadcast(&batch_start);
+    pthread_mutex_unlock(&batch_lock);
+
+    for (int i = 0; i < batch_threads_started; i++)
+        pthread_join(batch_threads[i], NULL);
+
+    batch_threads_started = 0;
+}
+
+int uvc_getDataBatch(int dev_fd, uvc_batch_frame_t* frames, int max_frames, int* count, video_device_mode_info_t* vmode)
+{
+    struct v4l2_buffer bufs[UVC_BATCH_MAX];
+    int dequeued = 0;
+    int ret = 0;
+
+    *count = 0;
+
+    if (max_frames <= 0)
+        return 1;
+    if (max_frames > UVC_BATCH_MAX)
+        max_frames = UVC_BATCH_MAX;
+
+    // Wait once, then take every buffer the device has filled meanwhile.
+    // The device fd is non-blocking, so DQBUF fails with EAGAIN once no filled buffer is left.
+    if (uvc_dequeueBuffer(dev_fd, &bufs[0]) != 0)
+        return 1;
+    dequeued = 1;
+
+    while (dequeued < max_frames)
+    {
+        struct v4l2_buffer* buf = &bufs[dequeued];
+        memset(buf, 0, sizeof(*buf));
+        buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf->memory = V4L2_MEMORY_MMAP;
+
+        if (uvc_do_ioctl(dev_fd, VIDIOC_DQBUF, buf) == -1)
+        {
+            // EAGAIN ends the batch. Other errors are handled by the next waiting dequeue.
+            break;
+        }
+
+        assert(buf->index < n_buffers);
+        dequeued++;
+    }
+
+    uvc_startBatchWorkers();
+
+    pthread_mutex_lock(&batch_lock);
+    batch_vmode = *vmode;
+    batch_job_count = 0;
+    batch_next_job = 0;
+    batch_jobs_done = 0;
+    batch_failed = 0;
+
+    for (int i = 0; i < dequeued; i++)
+    {
+        unsigned char* source = (unsigned char*)buffers[bufs[i].index].start;
+
+        frames[i].sequence = bufs[i].sequence;
+        frames[i].timestamp_us = (uint64_t)bufs[i].timestamp.tv_sec * 1000000 + bufs[i].timestamp.tv_usec;
+        // Motion detection compares consecutive frames, so it runs in order before the parallel conversion.
+        // Static frames are converted anyway: unlike uvc_getData, every frame has its own color_dest,
+        // which does not hold the previous image.
+        frames[i].changed = uvc_detectMotion(source, vmode);
+
+        batch_jobs[batch_job_count].source = source;
+        batch_jobs[batch_job_count].dest = frames[i].color_dest;
+        batch_jobs[batch_job_count].stats = frames[i].stats;
+        batch_job_count++;
+    }
+
+    pthread_cond_broadcast(&batch_start);
+    uvc_runBatchJobs();
+    while (batch_jobs_done < batch_job_count)
+        pthread_cond_wait(&batch_done, &batch_lock);
+
+    if (batch_failed)
+        ret = 1;
+    pthread_mutex_unlock(&batch_lock);
+
+    for (int i = 0; i < dequeued; i++)
+    {
+        if (uvc_queueBuffer(dev_fd, &bufs[i]) != 0)
+            ret = 1;
+    }
+
+    *count = dequeued;
+    return ret;
+}
+
+int uvc_createFramePool(video_device_mode_info_t* vmode, int count)
+{
+    if (frame_pool_count != 0)
+    {
+        fprintf(stderr, "Frame pool already exists\n");
+        return 1;
+    }
+
+    if (count <= 0 || count > UVC_FRAME_POOL_MAX)
+    {
+        fprintf(stderr, "Invalid frame pool size: %d (max %d)\n", count, UVC_FRAME_POOL_MAX);
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        uvc_frame_t* frame = &frame_pool[i];
+        memset(frame, 0, sizeof(*frame));
+        frame->pool_index = i;
+        frame->vmode = *vmode;
+        pthread_mutex_init(&frame->lock, NULL);
+        // Count the frame as allocated before allocating, so that a failure releases it too
+        frame_pool_count = i + 1;
+
+        frame->raw = (unsigned char*)memalign(UVC_FRAME_ALIGNMENT, uvc_rawSize(vmode));
+        if (frame->raw == NULL)
+        {
+            fprintf(stderr, "Out of memory when allocating frame pool\n");
+            uvc_destroyFramePool();
+            return 1;
+        }
+
+        for (int layout = 0; layout < UVC_LAYOUT_COUNT; layout++)
+        {
+            size_t size = (size_t)uvc_layoutWidth(vmode) * vmode->height * uvc_layoutChannels(layout);
+            frame->views[layout] = (unsigned char*)memalign(UVC_FRAME_ALIGNMENT, size);
+            if (frame->views[layout] == NULL)
+            {
+                fprintf(stderr, "Out of memory when allocating frame pool\n");
+                uvc_destroyFramePool();
+                return 1;
+            }
+
+            // The Y8I RGB conversion only writes the first channel of each pixel
+            memset(frame->views[layout], 0, size);
+            frame->view_sizes[layout] = size;
+        }
+    }
+
+    frame_pool_exhausted = 0;
+
+    return 0;
+}
+
+void uvc_destroyFramePool()
+{
+    for (int i = 0; i < frame_pool_count; i++)
+    {
+        uvc_frame_t* frame = &frame_pool[i];
+
+        if (__atomic_load_n(&frame->refcount, __ATOMIC_ACQUIRE) != 0)
+            fprintf(stderr, "Destroying frame pool while frame %d is still referenced\n", i);
+
+        free(frame->raw);
+        frame->raw = NULL;
+
+        for (int layout = 0; layout < UVC_LAYOUT_COUNT; layout++)
+        {
+            free(frame->views[layout]);
+            frame->views[layout] = NULL;
+            frame->view_sizes[layout] = 0;
+        }
+
+        pthread_mutex_destroy(&frame->lock);
+    }
+
+    frame_pool_count = 0;
+}
+
+int uvc_getFrame(int dev_fd, uvc_frame_t** frame, video_device_mode_info_t* vmode)
+{
+    uvc_frame_t* acquired = NULL;
+
+    if (frame_pool_count == 0)
+    {
+        fprintf(stderr, "No frame pool, call uvc_createFramePool first\n");
+        return 1;
+    }
+
+    // The frame buffers were sized for the mode the pool was created with
+    video_device_mode_info_t* pool_vmode = &frame_pool[0].vmode;
+    if (vmode->width != pool_vmode->width || vmode->height != pool_vmode->height
+            || vmode->pixel_format != pool_vmode->pixel_format)
+    {
+        fprintf(stderr, "Video mode %d x %d, %d does not match the frame pool: %d x %d, %d\n",
+                vmode->width, vmode->height, vmode->pixel_format,
+                pool_vmode->width, pool_vmode->height, pool_vmode->pixel_format);
+        return 1;
+    }
+
+    // A free frame has no references. Claim it by moving the count from 0 to 1.
+    for (int i = 0; i < frame_pool_count && acquired == NULL; i++)
+    {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&frame_pool[i].refcount, &expected, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            acquired = &frame_pool[i];
+        }
+    }
+
+    if (acquired == NULL)
+    {
+        __atomic_add_fetch(&frame_pool_exhausted, 1, __ATOMIC_RELAXED);
+        return UVC_ERROR_POOL_EXHAUSTED;
+    }
+
+    struct v4l2_buffer buf;
+
+    if (uvc_dequeueBuffer(dev_fd, &buf) != 0)
+    {
+        uvc_releaseFrame(acquired);
+        return 1;
+    }
+
+    // Copying the raw data is cheaper than converting it, and gives the device buffer back right away.
+    // Conversion happens only once a consumer asks for a view.
+    // frame->vmode is set once by uvc_createFramePool, the conversions rely on it matching the buffer sizes
+    size_t copy_size = uvc_rawSize(&acquired->vmode);
+    if (buf.bytesused != 0 && buf.bytesused < copy_size)
+        copy_size = buf.bytesused;
+    if (buffers[buf.index].length < copy_size)
+        copy_size = buffers[buf.index].length;
+
+    memcpy(acquired->raw, buffers[buf.index].start, copy_size);
+    acquired->raw_size = copy_size;
+    acquired->changed = uvc_detectMotion(acquired->raw, vmode);
+    for (int layout = 0; layout < UVC_LAYOUT_COUNT; layout++)
+        __atomic_store_n(&acquired->view_valid[layout], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&acquired->stats_valid, 0, __ATOMIC_RELAXED);
+
+    if (uvc_queueBuffer(dev_fd, &buf) != 0)
+    {
+        uvc_releaseFrame(acquired);
+        return 1;
+    }
+
+    *frame = acquired;
+    return 0;
+}
+
+unsigned char* uvc_getFrameView(uvc_frame_t* frame, int layout, size_t* size)
+{
+    if (layout < 0 || layout >= UVC_LAYOUT_COUNT)
+    {
+        fprintf(stderr, "Unknown frame layout: %d\n", layout);
+        return NULL;
+    }
+
+    if (size != NULL)
+        *size = frame->view_sizes[layout];
+
+    if (__atomic_load_n(&frame->view_valid[layout], __ATOMIC_ACQUIRE))
+        return frame->views[layout];
+
+    // Only one consumer converts, the others wait for the result
+    pthread_mutex_lock(&frame->lock);
+
+    int ret = 0;
+    if (!__atomic_load_n(&frame->view_valid[layout], __ATOMIC_ACQUIRE))
+    {
+        // The first conversion of the frame gathers its statistics on the way
+        uvc_frame_stats_t* stats = frame->stats_valid ? NULL : &frame->stats;
+
+        if (layout == UVC_LAYOUT_GRAY)
+            ret = uvc_convertToGray(frame->raw, frame->views[layout], &frame->vmode, stats);
+        else
+            ret = uvc_convertToRGB(frame->raw, frame->views[layout], &frame->vmode, stats);
+
+        if (ret == 0)
+        {
+            if (stats != NULL)
+                __atomic_store_n(&frame->stats_valid, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&frame->view_valid[layout], 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_unlock(&frame->lock);
+
+    return ret == 0 ? frame->views[layout] : NULL;
+}
+
+int uvc_getFrameStats(uvc_frame_t* frame, uvc_frame_stats_t* stats)
+{
+    if (!__atomic_load_n(&frame->stats_valid, __ATOMIC_ACQUIRE))
+    {
+        // A holder converting a view right now has the lock and gathers the statistics on the way,
+        // so check again once it is done before converting anything
+        pthread_mutex_lock(&frame->lock);
+        int valid = frame->stats_valid;
+        pthread_mutex_unlock(&frame->lock);
+
+        // Without any view yet, the luma only conversion is the cheapest way to the statistics.
+        // The first view conversion of a frame always gathers them.
+        if (!valid && uvc_getFrameView(frame, UVC_LAYOUT_GRAY, NULL) == NULL)
+            return 1;
+    }
+
+    *stats = frame->stats;
+    return 0;
+}
+
+int uvc_convertFrameRegion(uvc_frame_t* frame, int layout, unsigned int x, unsigned int y,
+                           unsigned int width, unsigned int height, unsigned char* dest)
+{
+    video_device_mode_info_t* vmode = &frame->vmode;
+    unsigned int layout_width = uvc_layoutWidth(vmode);
+
+    if (layout < 0 || layout >= UVC_LAYOUT_COUNT)
+    {
+        fprintf(stderr, "Unknown frame layout: %d\n", layout);
+        return 1;
+    }
+
+    // Written to not overflow for any input
+    if (x > layout_width || width > layout_width - x || y > vmode->height || height > vmode->height - y)
+    {
+        fprintf(stderr, "Region %d, %d, %d x %d is outside of the %d x %d frame\n",
+                x, y, width, height, layout_width, vmode->height);
+        return 1;
+    }
+
+    unsigned int channels = uvc_layoutChannels(layout);
+
+    // A view that is already converted only needs the region copied out of it
+    if (__atomic_load_n(&frame->view_valid[layout], __ATOMIC_ACQUIRE))
+    {
+        for (unsigned int line = 0; line < height; line++)
+        {
+            memcpy(dest + (size_t)line * width * channels,
+                   frame->views[layout] + ((size_t)(y + line) * layout_width + x) * channels,
+                   (size_t)width * channels);
+        }
+        return 0;
+    }
+
+    parse_uvc_image_params params;
+    params.src = frame->raw;
+    params.src_origin = frame->raw;
+    params.dst_rgb = dest;
+    params.dst_rgb_origin = dest;
+    params.start_y = y;
+    params.end_y = y + height;
+    params.width = vmode->width;
+    params.start_x = x;
+    params.end_x = x + width;
+    params.stats = NULL;
+
+    switch (vmode->pixel_format)
+    {
+    case UVC_PIXELFORMAT_YUV422:
+        if (layout == UVC_LAYOUT_GRAY)
+            uvc_convertYUV422GrayRegion(&params);
+        else
+            uvc_convertYUV422Region(&params);
+        break;
+    case UVC_PIXELFORMAT_Y8I:
+        uvc_convertY8IRegion(&params, channels);
+        break;
+    default:
+        fprintf(stderr, "Cannot decompress data: Unknown pixel format: %d\n", vmode->pixel_format);
+        return 1;
+    }
+
+    return 0;
+}
+
+void uvc_retainFrame(uvc_frame_t* frame)
+{
+    __atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void uvc_releaseFrame(uvc_frame_t* frame)
+{
+    int remaining = __atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_RELEASE);
+    assert(remaining >= 0);
+    (void)remaining;
+}
+
+int uvc_framePoolAvailable()
+{
+    int available = 0;
+    for (int i = 0; i < frame_pool_count; i++)
+    {
+        if (__atomic_load_n(&frame_pool[i].refcount, __ATOMIC_RELAXED) == 0)
+            available++;
+    }
+    return available;
+}
+
+unsigned int uvc_framePoolExhaustedCount()
+{
+    return __atomic_load_n(&frame_pool_exhausted, __ATOMIC_RELAXED);
+}
+
+#define UVC_SHM_MAGIC 0x31435655 // "UVC1"
+
+struct uvc_shm_slot_t
+{
+    // Seqlock: odd while the publisher writes the slot
+    uint32_t seq;
+    uint32_t sequence;
+    uint64_t timestamp_us;
+    uint64_t size;
+    uint64_t offset;
+};
+
+struct uvc_shm_header_t
+{
+    uint32_t magic;
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint32_t width;
+    uint32_t height;
+    int32_t layout;
+    // Number of frames published so far. Subscribers futex wait on this.
+    uint32_t published;
+    struct uvc_shm_slot_t slots[];
+};
+
+static long uvc_futex(uint32_t* word, int op, uint32_t value, const struct timespec* timeout)
+{
+    // Not FUTEX_PRIVATE_FLAG: the word lives in memory shared between processes
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static size_t uvc_alignUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+int uvc_createPublisher(uvc_publisher_t* pub, video_device_mode_info_t* vmode, int layout, int slot_count)
+{
+    size_t slot_size;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    memset(pub, 0, sizeof(*pub));
+    pub->memfd = -1;
+
+    // The newest frame must stay readable while the publisher writes the next one
+    if (slot_count < 2)
+    {
+        fprintf(stderr, "Invalid publisher slot count: %d, at least 2 are needed\n", slot_count);
+        return 1;
+    }
+
+    if (layout == UVC_LAYOUT_RAW)
+        slot_size = uvc_rawSize(vmode);
+    else if (layout >= 0 && layout < UVC_LAYOUT_COUNT)
+        slot_size = (size_t)uvc_layoutWidth(vmode) * vmode->height * uvc_layoutChannels(layout);
+    else
+    {
+        fprintf(stderr, "Unknown frame layout: %d\n", layout);
+        return 1;
+    }
+
+    // Page aligned slots keep every frame on its own pages, away from the frequently written headers
+    slot_size = uvc_alignUp(slot_size, page_size);
+    size_t header_size = uvc_alignUp(sizeof(uvc_shm_header_t) + slot_count * sizeof(uvc_shm_slot_t), page_size);
+    size_t map_size = header_size + slot_size * slot_count;
+
+    pub->memfd = memfd_create("uvc_frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (pub->memfd == -1)
+    {
+        int errcode = errno;
+        fprintf(stderr, "memfd_create failed: %s %d\n", strerror(errcode), errcode);
+        return 1;
+    }
+
+    if (ftruncate(pub->memfd, map_size) == -1)
+    {
+        int errcode = errno;
+        fprintf(stderr, "Failed sizing shared frame memory: %s %d\n", strerror(errcode), errcode);
+        uvc_destroyPublisher(pub);
+        return 1;
+    }
+
+    // Subscribers can rely on the size never changing under their mapping
+    if (fcntl(pub->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+    {
+        int errcode = errno;
+        fprintf(stderr, "Failed sealing shared frame memory: %s %d\n", strerror(errcode), errcode);
+        uvc_destroyPublisher(pub);
+        return 1;
+    }
+
+    void* mapping = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, pub->memfd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed mmapping shared frame memory\n");
+        uvc_destroyPublisher(pub);
+        return 1;
+    }
+
+    pub->header = (uvc_shm_header_t*)mapping;
+    pub->map_size = map_size;
+
+    // ftruncate zero fills, so every slot starts with an even seq and no data
+    pub->header->slot_count = slot_count;
+    pub->header->slot_size = slot_size;
+    pub->header->width = uvc_layoutWidth(vmode);
+    pub->header->height = vmode->height;
+    pub->header->layout = layout;
+    if (layout == UVC_LAYOUT_RAW)
+        pub->header->width = vmode->width;
+
+    for (int i = 0; i < slot_count; i++)
+        pub->header->slots[i].offset = header_size + slot_size * i;
+
+    // Written last: subscribers refuse the mapping until the header is complete
+    __atomic_store_n(&pub->header->magic, UVC_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void uvc_destroyPublisher(uvc_publisher_t* pub)
+{
+    if (pub->header != NULL && munmap(pub->header, pub->map_size) == -1)
+        fprintf(stderr, "Failed unmapping shared frame memory\n");
+
+    if (pub->memfd != -1)
+        close(pub->memfd);
+
+    pub->header = NULL;
+    pub->map_size = 0;
+    pub->memfd = -1;
+}
+
+int uvc_getPublisherPath(uvc_publisher_t* pub, char* path, size_t path_size)
+{
+    int written = snprintf(path, path_size, "/proc/%d/fd/%d", (int)getpid(), pub->memfd);
+    if (written < 0 || (size_t)written >= path_size)
+    {
+        fprintf(stderr, "Publisher path does not fit in %d bytes\n", (int)path_size);
+        return 1;
+    }
+
+    return 0;
+}
+
+int uvc_publishData(int dev_fd, uvc_publisher_t* pub, video_device_mode_info_t* vmode)
+{
+    uvc_shm_header_t* header = pub->header;
+    struct v4l2_buffer buf;
+
+    if (uvc_dequeueBuffer(dev_fd, &buf) != 0)
+        return 1;
+
+    uint32_t published = __atomic_load_n(&header->published, __ATOMIC_RELAXED);
+    uvc_shm_slot_t* slot = &header->slots[published % header->slot_count];
+    unsigned char* dest = (unsigned char*)header + slot->offset;
+    unsigned char* source = (unsigned char*)buffers[buf.index].start;
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    int ret = 0;
+    size_t size = 0;
+
+    // Mark the slot as being written before touching the data
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    switch (header->layout)
+    {
+    case UVC_LAYOUT_RAW:
+        size = uvc_rawSize(vmode);
+        if (buf.bytesused != 0 && buf.bytesused < size)
+            size = buf.bytesused;
+        memcpy(dest, source, size);
+        break;
+    case UVC_LAYOUT_GRAY:
+        size = (size_t)uvc_layoutWidth(vmode) * vmode->height;
+        ret = uvc_convertToGray(source, dest, vmode, NULL);
+        break;
+    default:
+        size = (size_t)uvc_layoutWidth(vmode) * vmode->height * 3;
+        ret = uvc_convertToRGB(source, dest, vmode, NULL);
+        break;
+    }
+
+    slot->sequence = buf.sequence;
+    slot->timestamp_us = (uint64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+    slot->size = size;
+
+    // Even again: the slot is consistent. A failed conversion still leaves the slot unpublished.
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+    if (uvc_queueBuffer(dev_fd, &buf) != 0 || ret != 0)
+        return 1;
+
+    __atomic_store_n(&header->published, published + 1, __ATOMIC_RELEASE);
+    uvc_futex(&header->published, FUTEX_WAKE, INT_MAX, NULL);
+
+    return 0;
+}
+
+int uvc_sendPublisher(uvc_publisher_t* pub, int socket_fd)
+{
+    char path[64];
+    char payload = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+
+    // Reopening our own descriptor read-only is always allowed, and keeps subscribers from writing the ring
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", pub->memfd);
+    int readonly_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (readonly_fd == -1)
+    {
+        int errcode = errno;
+        fprintf(stderr, "Failed reopening shared frame memory read-only: %s %d\n", strerror(errcode), errcode);
+        return 1;
+    }
+
+    // At least one byte of data has to accompany the descriptor
+    iov.iov_base = &payload;
+    iov.iov_len = 1;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &readonly_fd, sizeof(int));
+
+    ssize_t sent;
+    do
+    {
+        sent = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+
+    int errcode = errno;
+    close(readonly_fd);
+
+    if (sent != 1)
+    {
+        fprintf(stderr, "Failed sending shared frame memory: %s %d\n", strerror(errcode), errcode);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Returns 0 if the slot data lies inside the subscriber's mapping
+static int uvc_checkSharedSlot(uvc_subscriber_t* sub, uint64_t offset, uint64_t size)
+{
+    if (offset < sizeof(uvc_shm_header_t) || offset > sub->map_size || sub->slot_size > sub->map_size - offset)
+        return 1;
+    if (size > sub->slot_size)
+        return 1;
+
+    return 0;
+}
+
+// Maps the ring behind sub->memfd read-only
+static int uvc_mapSubscriber(uvc_subscriber_t* sub, const char* name)
+{
+    struct stat stat_s;
+
+    if (fstat(sub->memfd, &stat_s) == -1 || (size_t)stat_s.st_size < sizeof(uvc_shm_header_t))
+    {
+        fprintf(stderr, "Invalid shared frame memory: %s\n", name);
+        uvc_closeSubscriber(sub);
+        return 1;
+    }
+
+    void* mapping = mmap(NULL, stat_s.st_size, PROT_READ, MAP_SHARED, sub->memfd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed mmapping shared frame memory: %s\n", name);
+        uvc_closeSubscriber(sub);
+        return 1;
+    }
+
+    sub->header = (const uvc_shm_header_t*)mapping;
+    sub->map_size = stat_s.st_size;
+
+    if (__atomic_load_n(&sub->header->magic, __ATOMIC_ACQUIRE) != UVC_SHM_MAGIC)
+    {
+        fprintf(stderr, "Shared frame memory is not initialized: %s\n", name);
+        uvc_closeSubscriber(sub);
+        return 1;
+    }
+
+    // The memory may come from anywhere, check the layout fits the mapping before trusting it
+    const uvc_shm_header_t* header = sub->header;
+    size_t slots_room = (sub->map_size - sizeof(uvc_shm_header_t)) / sizeof(uvc_shm_slot_t);
+    if (header->slot_count < 2 || header->slot_count > slots_room || header->slot_size > sub->map_size)
+    {
+        fprintf(stderr, "Invalid shared frame memory layout: %s\n", name);
+        uvc_closeSubscriber(sub);
+        return 1;
+    }
+
+    sub->slot_count = header->slot_count;
+    sub->slot_size = header->slot_size;
+
+    for (uint32_t i = 0; i < sub->slot_count; i++)
+    {
+        if (uvc_checkSharedSlot(sub, header->slots[i].offset, header->slots[i].size) != 0)
+        {
+            fprintf(stderr, "Shared frame slot %d is outside of the mapping: %s\n", i, name);
+            uvc_closeSubscriber(sub);
+            return 1;
+        }
+    }
+
+    // Only frames published after subscribing are waited for
+    sub->last_published = __atomic_load_n(&sub->header->published, __ATOMIC_ACQUIRE);
+
+    return 0;
+}
+
+int uvc_receiveSubscriber(uvc_subscriber_t* sub, int socket_fd)
+{
+    char payload;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+
+    memset(sub, 0, sizeof(*sub));
+    sub->memfd = -1;
+
+    iov.iov_base = &payload;
+    iov.iov_len = 1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do
+    {
+        received = recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+
+    if (received != 1)
+    {
+        int errcode = received == -1 ? errno : EPROTO;
+        fprintf(stderr, "Failed receiving shared frame memory: %s %d\n", strerror(errcode), errcode);
+        return 1;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+    {
+        fprintf(stderr, "No shared frame memory descriptor in message\n");
+        return 1;
+    }
+
+    memcpy(&sub->memfd, CMSG_DATA(cmsg), sizeof(int));
+
+    return uvc_mapSubscriber(sub, "received descriptor");
+}
+
+int uvc_openSubscriber(uvc_subscriber_t* sub, const char* path)
+{
+    memset(sub, 0, sizeof(*sub));
+
+    sub->memfd = open(path, O_RDONLY | O_CLOEXEC);
+    if (sub->memfd == -1)
+    {
+        int errcode = errno;
+        fprintf(stderr, "Failed opening shared frame memory %s: %s %d\n", path, strerror(errcode), errcode);
+        return 1;
+    }
+
+    return uvc_mapSubscriber(sub, path);
+}
+
+void uvc_closeSubscriber(uvc_subscriber_t* sub)
+{
+    if (sub->header != NULL && munmap((void*)sub->header, sub->map_size) == -1)
+        fprintf(stderr, "Failed unmapping shared frame memory\n");
+
+    if (sub->memfd != -1)
+        close(sub->memfd);
+
+    sub->header = NULL;
+    sub->map_size = 0;
+    sub->memfd = -1;
+}
+
+int uvc_waitSharedFrame(uvc_subscriber_t* sub, int timeout_ms, const unsigned char** data, uvc_shm_frame_info_t* info)
+{
+    const uvc_shm_header_t* header = sub->header;
+    struct timespec timeout;
+    // Interrupted and spurious wakeups only wait for what is left of the timeout
+    uint64_t deadline = uvc_nowUs() + (uint64_t)(timeout_ms < 0 ? 0 : timeout_ms) * 1000;
+
+    for (;;)
+    {
+        uint32_t published = __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+
+        if (published == sub->last_published)
+        {
+            if (timeout_ms >= 0)
+            {
+                uint64_t now = uvc_nowUs();
+                if (now >= deadline)
+                    return 1;
+
+                timeout.tv_sec = (deadline - now) / 1000000;
+                timeout.tv_nsec = (long)((deadline - now) % 1000000) * 1000;
+            }
+
+            // The kernel only reads the futex word, so a read-only mapping is enough to wait on it
+            long r = uvc_futex((uint32_t*)&header->published, FUTEX_WAIT, published,
+                               timeout_ms < 0 ? NULL : &timeout);
+            int errcode = errno;
+            if (r == -1 && errcode == ETIMEDOUT)
+                return 1;
+            if (r == -1 && errcode != EAGAIN && errcode != EINTR)
+            {
+                fprintf(stderr, "futex wait failed: %s %d\n", strerror(errcode), errcode);
+                return 1;
+            }
+            continue;
+        }
+
+        // Always hand out the newest frame, a slow subscriber skips the ones in between
+        unsigned int index = (published - 1) % sub->slot_count;
+        const uvc_shm_slot_t* slot = &header->slots[index];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1)
+        {
+            // Lapped by the publisher while it is rewriting the slot, take the next frame instead
+            continue;
+        }
+
+        // Read once and checked, the header is only validated when mapping
+        uint64_t offset = slot->offset;
+        uint64_t size = slot->size;
+        if (uvc_checkSharedSlot(sub, offset, size) != 0)
+        {
+            fprintf(stderr, "Shared frame slot %d is outside of the mapping\n", index);
+            return 1;
+        }
+
+        info->slot = index;
+        info->slot_seq = seq;
+        info->sequence = slot->sequence;
+        info->timestamp_us = slot->timestamp_us;
+        info->size = size;
+        info->width = header->width;
+        info->height = header->height;
+        info->layout = header->layout;
+        info->dropped = published - sub->last_published - 1;
+
+        if (uvc_validateSharedFrame(sub, info) != 0)
+            continue;
+
+        *data = (const unsigned char*)header + offset;
+        sub->last_published = published;
+        return 0;
+    }
+}
+
+int uvc_validateSharedFrame(uvc_subscriber_t* sub, uvc_shm_frame_info_t* info)
+{
+    if (info->slot >= sub->slot_count)
+        return 1;
+
+    const uvc_shm_slot_t* slot = &sub->header->slots[info->slot];
+
+    // Order the caller's reads of the frame data before re-reading the seqlock
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != info->slot_seq)
+        return 1;
+
+    return 0;
+}
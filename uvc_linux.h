@@ -2,10 +2,44 @@
 #define __UVC_LINUX_H_
 
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #define UVC_PIXELFORMAT_YUV422 1448695129
 #define UVC_PIXELFORMAT_Y8I 541669465
 
+#define UVC_FRAME_POOL_MAX 32
+#define UVC_FRAME_ALIGNMENT 64
+
+// Luma statistics gathered while a frame is converted
+struct uvc_frame_stats_t
+{
+    uint32_t histogram[256];
+    uint32_t pixel_count;
+    uint64_t luma_sum;
+    // Sum of squared differences between horizontally adjacent luma samples
+    uint64_t gradient_sum;
+    unsigned char min;
+    unsigned char max;
+    double mean;
+    // gradient_sum per pixel, higher for sharper images
+    double sharpness;
+};
+
+// Maximum number of frames uvc_getDataBatch returns at once
+#define UVC_BATCH_MAX 32
+
+// Reasons for stream recovery
+#define UVC_RECOVERY_REQUESTED 0
+#define UVC_RECOVERY_EIO 1
+#define UVC_RECOVERY_TIMEOUT 2
+// VIDIOC_DQBUF failed with ENODEV or ENXIO: the device was unplugged or re-enumerates.
+// Recovery goes straight to reopening the device.
+#define UVC_RECOVERY_DISCONNECT 3
+
+// Returned by uvc_getFrame when every frame in the pool is still held by a consumer
+#define UVC_ERROR_POOL_EXHAUSTED 2
+
 struct video_device_mode_info_t
 {
     unsigned int width;
@@ -17,6 +51,61 @@ struct video_device_mode_info_t
     char dev_name[256];
 };
 
+struct uvc_open_timing_t
+{
+    uint64_t querycap_us;
+    uint64_t crop_us;
+    uint64_t set_format_us;
+    uint64_t request_buffers_us;
+    uint64_t map_buffers_us;
+    // Queueing the buffers and VIDIOC_STREAMON
+    uint64_t stream_on_us;
+    // From VIDIOC_STREAMON to the first frame
+    uint64_t first_frame_us;
+    uint64_t time_to_first_frame_us;
+    int fast_open;
+    unsigned int initial_buffers;
+};
+
+struct uvc_recovery_report_t
+{
+    // Of the latest recovery
+    int reason;
+    int escalated;
+    int success;
+    uint64_t duration_us;
+    // Over all recoveries
+    unsigned int count;
+    uint64_t total_duration_us;
+};
+
+// Layouts a frame can be converted to
+#define UVC_LAYOUT_RGB 0
+#define UVC_LAYOUT_GRAY 1
+#define UVC_LAYOUT_COUNT 2
+// The unconverted device data, only valid for publishing
+#define UVC_LAYOUT_RAW UVC_LAYOUT_COUNT
+
+struct uvc_frame_t
+{
+    // Copy of the device data, converted only when a view is requested
+    unsigned char* raw;
+    size_t raw_size;
+    video_device_mode_info_t vmode;
+    // Cached conversions, one per layout
+    unsigned char* views[UVC_LAYOUT_COUNT];
+    size_t view_sizes[UVC_LAYOUT_COUNT];
+    int view_valid[UVC_LAYOUT_COUNT];
+    pthread_mutex_t lock;
+    // 0 when motion detection found the frame static, 1 otherwise
+    int changed;
+    // Gathered by the first view conversion of the frame
+    uvc_frame_stats_t stats;
+    int stats_valid;
+    int refcount;
+    int pool_index;
+};
+
 /**
  * @brief Fills the given video_modes container with up to count elements
  * This function uses /sys/class/video4linux to find any video devices and queries their
@@ -37,6 +126,28 @@ extern int uvc_do_ioctl(int dev_fd, int request, void* argument);
  * @return 0 on success
  */
 int uvc_openDevice(int dev_fd, video_device_mode_info_t* vmode);
+
+/**
+ * @brief Opens the device like uvc_openDevice, reusing the negotiation result of a previous open
+ * If cache_path holds a negotiation for the same device and mode, capability and crop queries are skipped
+ * and only a few buffers are mapped before streaming. The rest are added one per frame once the stream runs.
+ * Otherwise the full open is done and its result is written to cache_path.
+ * @param dev_fd: An open file descriptor to a video device
+ * @param vmode: The video mode that is to be opened, modified like with uvc_openDevice
+ * @param cache_path: File holding the negotiation result
+ * @return 0 on success
+ */
+int uvc_openDeviceFast(int dev_fd, video_device_mode_info_t* vmode, const char* cache_path);
+extern int uvc_saveNegotiation(const char* path, video_device_mode_info_t* vmode);
+
+/**
+ * @brief Fills timing with the duration of each phase of the latest open
+ * Phases skipped by a fast open are 0. time_to_first_frame_us is measured from the start of
+ * uvc_openDevice or uvc_openDeviceFast to the first frame taken from the device.
+ * @return 0 on success, 1 if no frame has been received since the open
+ */
+int uvc_getOpenTiming(uvc_open_timing_t* timing);
+
 extern int uvc_cleanup(int dev_fd);
 extern int uvc_openStream(int dev_fd);
 extern int uvc_closeStream(int dev_fd);
@@ -50,5 +161,270 @@ extern int uvc_closeStream(int dev_fd);
  */
 int uvc_getData(int dev_fd, unsigned char* color_dest, video_device_mode_info_t* vmode);
 
+/**
+ * @brief Same as uvc_getData, also filling stats with the luma statistics gathered during conversion
+ * @param stats: Will be filled with the statistics of the frame. Not filled for static frames skipped
+ *               by motion detection.
+ * @return 0 on success
+ */
+int uvc_getDataStats(int dev_fd, unsigned char* color_dest, video_device_mode_info_t* vmode, uvc_frame_stats_t* stats);
+
+struct uvc_batch_frame_t
+{
+    // A buffer of vmode->width * vmode->height * 3 size, set by the caller
+    unsigned char* color_dest;
+    uint32_t sequence;
+    uint64_t timestamp_us;
+    // 0 when motion detection found the frame static. The frame is converted regardless,
+    // skip_static only applies to uvc_getData.
+    int changed;
+    // When not NULL, filled with the statistics of the frame, set by the caller
+    uvc_frame_stats_t* stats;
+};
+
+/**
+ * @brief Waits for new video data once and reads every frame the device has ready
+ * The frames are converted in parallel by worker threads and returned oldest first.
+ * The device file descriptor must be opened with O_NONBLOCK.
+ * @param dev_fd: An open file descriptor that's outputting video streams to the device file descriptor
+ * @param frames: Up to max_frames entries, each with color_dest set
+ * @param max_frames: Maximum number of frames to read, at most UVC_BATCH_MAX
+ * @param count: Will be set to the number of frames filled
+ * @param vmode: The video mode that was used to open the stream
+ * @return 0 on success
+ */
+int uvc_getDataBatch(int dev_fd, uvc_batch_frame_t* frames, int max_frames, int* count, video_device_mode_info_t* vmode);
+
+/**
+ * @brief Restarts a stream that failed with EIO or stopped delivering frames
+ * First the stream is turned off and on again with all buffers re-queued, keeping the existing mappings.
+ * That step is skipped for UVC_RECOVERY_DISCONNECT, where the device node no longer exists.
+ * Only if that does not bring frames back, the device is closed and opened again, waiting for the
+ * device node to reappear after a USB re-enumeration. The new device file takes over dev_fd.
+ * A reopen does not change the numbers reported by uvc_getOpenTiming.
+ * @param dev_fd: An open file descriptor that's outputting video streams to the device file descriptor
+ * @param reason: One of UVC_RECOVERY_*, stored in the recovery report
+ * @return 0 on success
+ */
+int uvc_recoverStream(int dev_fd, int reason);
+
+/**
+ * @brief Makes the functions reading frames call uvc_recoverStream on EIO, disconnects and select timeouts
+ * Each read recovers at most once. If the stream fails again, or the recovery fails, the read fails.
+ * Disabled by default, in which case those errors make the call fail.
+ */
+extern void uvc_setAutoRecovery(int enabled);
+
+/**
+ * @brief Fills report with the latest recovery and totals over all recoveries
+ * @return 0 on success, 1 if no recovery has happened
+ */
+int uvc_getRecoveryReport(uvc_recovery_report_t* report);
+
+// Motion detection compares the luma of 16 x 16 pixel blocks
+#define UVC_MOTION_BLOCK_SIZE 16
+
+struct uvc_motion_params_t
+{
+    // A block changed when its mean absolute luma difference to the previous frame exceeds this
+    unsigned int threshold;
+    // The frame changed when at least this many blocks changed
+    unsigned int min_changed_blocks;
+    // Compare every row_step:th row of each block. 1 compares every row.
+    unsigned int row_step;
+    // When set, uvc_getData does not convert static frames and leaves color_dest untouched
+    int skip_static;
+};
+
+struct uvc_motion_result_t
+{
+    int changed;
+    unsigned int changed_blocks;
+    unsigned int blocks_x;
+    unsigned int blocks_y;
+    // blocks_x * blocks_y entries, row by row, 1 for each changed block
+    const unsigned char* block_mask;
+};
+
+/**
+ * @brief Enables comparing the luma of every YUYV frame against the previous frame before it is converted
+ * The comparison reads the Y samples straight from the device buffer, using AVX2 when the CPU supports it.
+ * Frames of other pixel formats are always reported as changed.
+ * @param vmode: The video mode that was used to open the stream
+ * @param params: Thresholds and sampling of the detection
+ * @return 0 on success
+ */
+int uvc_enableMotionDetection(video_device_mode_info_t* vmode, uvc_motion_params_t* params);
+extern void uvc_disableMotionDetection();
+
+/**
+ * @brief Fills result with the motion detection result of the latest frame read
+ * The block mask stays valid until the next frame is read.
+ * @return 0 on success, 1 if motion detection is not enabled
+ */
+int uvc_getMotionResult(uvc_motion_result_t* result);
+
+/**
+ * @brief Allocates a bounded pool of aligned output frames for uvc_getFrame
+ * All frames are allocated up front so that capturing does not allocate memory afterwards.
+ * @param vmode: The video mode that was used to open the stream, used to size the frames
+ * @param count: Number of frames in the pool, at most UVC_FRAME_POOL_MAX
+ * @return 0 on success
+ */
+int uvc_createFramePool(video_device_mode_info_t* vmode, int count);
+extern void uvc_destroyFramePool();
+
+/**
+ * @brief Fills the next free frame of the pool with new video data
+ * The frame keeps the raw device data. Nothing is converted until a view is requested with
+ * uvc_getFrameView or uvc_convertFrameRegion.
+ * The returned frame holds one reference owned by the caller. Hand the frame to other consumers
+ * with uvc_retainFrame and have every holder call uvc_releaseFrame once done with it.
+ * @param dev_fd: An open file descriptor that's outputting video streams to the device file descriptor
+ * @param frame: Will be set to the filled frame
+ * @param vmode: The video mode that was used to open the stream. Must match the mode the pool was created with.
+ * @return 0 on success, UVC_ERROR_POOL_EXHAUSTED if no frame is free. The device is not read in that case.
+ */
+int uvc_getFrame(int dev_fd, uvc_frame_t** frame, video_device_mode_info_t* vmode);
+/**
+ * @brief Returns the frame converted to the given layout, converting it on first request
+ * The conversion is cached in the frame and shared by all holders of the frame.
+ * UVC_LAYOUT_GRAY reads only the luma and skips color conversion.
+ * @param frame: A frame returned by uvc_getFrame
+ * @param layout: UVC_LAYOUT_RGB or UVC_LAYOUT_GRAY
+ * @param size: If not NULL, will be set to the size of the view in bytes
+ * @return The view, or NULL on failure
+ */
+unsigned char* uvc_getFrameView(uvc_frame_t* frame, int layout, size_t* size);
+
+/**
+ * @brief Fills stats with the luma statistics of the frame
+ * The statistics come from the first view conversion of the frame. If no view has been requested yet,
+ * the GRAY view is converted for them.
+ * @return 0 on success
+ */
+int uvc_getFrameStats(uvc_frame_t* frame, uvc_frame_stats_t* stats);
+
+/**
+ * @brief Converts a rectangle of the frame into the given buffer without converting the whole frame
+ * The region is copied from the cached view if one exists already.
+ * @param frame: A frame returned by uvc_getFrame
+ * @param layout: UVC_LAYOUT_RGB or UVC_LAYOUT_GRAY
+ * @param x, y, width, height: The rectangle, in pixels of the converted image
+ * @param dest: A buffer of width * height * channels size, filled row by row without padding
+ * @return 0 on success
+ */
+int uvc_convertFrameRegion(uvc_frame_t* frame, int layout, unsigned int x, unsigned int y,
+                           unsigned int width, unsigned int height, unsigned char* dest);
+extern void uvc_retainFrame(uvc_frame_t* frame);
+extern void uvc_releaseFrame(uvc_frame_t* frame);
+extern int uvc_framePoolAvailable();
+extern unsigned int uvc_framePoolExhaustedCount();
+
+// Layout of the shared memory, only accessed through the uvc_*Publisher / uvc_*Subscriber functions
+struct uvc_shm_header_t;
+
+struct uvc_publisher_t
+{
+    int memfd;
+    struct uvc_shm_header_t* header;
+    size_t map_size;
+};
+
+struct uvc_subscriber_t
+{
+    int memfd;
+    const struct uvc_shm_header_t* header;
+    size_t map_size;
+    // Ring layout, checked against map_size when mapping
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint32_t last_published;
+};
+
+struct uvc_shm_frame_info_t
+{
+    unsigned int slot;
+    // Seqlock value of the slot when it was read, used by uvc_validateSharedFrame
+    uint32_t slot_seq;
+    uint32_t sequence;
+    uint64_t timestamp_us;
+    size_t size;
+    unsigned int width;
+    unsigned int height;
+    int layout;
+    // Frames published since the previous wait that this subscriber did not see
+    uint32_t dropped;
+};
+
+/**
+ * @brief Creates a memfd backed ring of frame slots that other processes can map read-only
+ * A V4L2 device can only be streamed by one process. The publisher streams the device and
+ * writes every frame into the ring once; any number of local subscribers read it in place.
+ * @param pub: Will be filled with the publisher state
+ * @param vmode: The video mode that was used to open the stream, used to size the slots
+ * @param layout: UVC_LAYOUT_RGB, UVC_LAYOUT_GRAY or UVC_LAYOUT_RAW
+ * @param slot_count: Number of slots in the ring, at least 2
+ * @return 0 on success
+ */
+int uvc_createPublisher(uvc_publisher_t* pub, video_device_mode_info_t* vmode, int layout, int slot_count);
+extern void uvc_destroyPublisher(uvc_publisher_t* pub);
+
+/**
+ * @brief Sends a read-only descriptor of the ring over a Unix domain socket, for uvc_receiveSubscriber
+ * This is the supported way to hand the ring to subscribers running as other users.
+ * @param pub: A publisher created with uvc_createPublisher
+ * @param socket_fd: A connected AF_UNIX socket
+ * @return 0 on success
+ */
+int uvc_sendPublisher(uvc_publisher_t* pub, int socket_fd);
+
+/**
+ * @brief Fills path with the /proc path subscribers can pass to uvc_openSubscriber
+ * Opening another process's /proc/<pid>/fd entry needs ptrace read access to it: the subscriber must
+ * run as the same user and the publisher must be dumpable. Otherwise use uvc_sendPublisher.
+ * @return 0 on success
+ */
+int uvc_getPublisherPath(uvc_publisher_t* pub, char* path, size_t path_size);
+
+/**
+ * @brief Reads a new frame from the device, converts it straight into the next slot and wakes the subscribers
+ * @param dev_fd: An open file descriptor that's outputting video streams to the device file descriptor
+ * @param pub: A publisher created with uvc_createPublisher
+ * @param vmode: The video mode that was used to open the stream
+ * @return 0 on success
+ */
+int uvc_publishData(int dev_fd, uvc_publisher_t* pub, video_device_mode_info_t* vmode);
+
+/**
+ * @brief Maps the ring of a publisher read-only
+ * @param sub: Will be filled with the subscriber state
+ * @param path: The path returned by uvc_getPublisherPath in the publishing process
+ * @return 0 on success
+ */
+int uvc_openSubscriber(uvc_subscriber_t* sub, const char* path);
+
+/**
+ * @brief Maps the ring of a publisher read-only, receiving it from uvc_sendPublisher
+ * @param sub: Will be filled with the subscriber state
+ * @param socket_fd: A connected AF_UNIX socket the publisher sends the ring on
+ * @return 0 on success
+ */
+int uvc_receiveSubscriber(uvc_subscriber_t* sub, int socket_fd);
+extern void uvc_closeSubscriber(uvc_subscriber_t* sub);
+
+/**
+ * @brief Waits for the publisher to write a frame this subscriber has not seen yet
+ * The data points into the shared ring and is not copied. Once done with it, call
+ * uvc_validateSharedFrame to check that the publisher did not overwrite the slot meanwhile.
+ * @param sub: A subscriber opened with uvc_openSubscriber
+ * @param timeout_ms: Maximum time to wait, or -1 to wait forever
+ * @param data: Will be set to the frame data
+ * @param info: Will be filled with the frame properties
+ * @return 0 on success, 1 on timeout or failure
+ */
+int uvc_waitSharedFrame(uvc_subscriber_t* sub, int timeout_ms, const unsigned char** data, uvc_shm_frame_info_t* info);
+extern int uvc_validateSharedFrame(uvc_subscriber_t* sub, uvc_shm_frame_info_t* info);
+
 #endif // __UVC_LINUX_H_
 